@@ -1,216 +1,3004 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define BUFFER_SIZE 10240
+#define SCAN_CHUNK_SIZE (1 << 20)  // bytes read per step when streaming a suspected file
+#define MAP_WINDOW_SIZE (1u << 30)  // bytes handed to the matcher per step when scanning a mapping
+#define SPLIT_FILE_SIZE (64L << 20)  // directory scan: files above this are split into ranges
+#define RANGE_SIZE (16L << 20)       // directory scan: bytes per range of a split file
+#define BATCH_SIZE (4L << 20)        // directory scan: small files are claimed until this many bytes
+#define IO_CHUNK_SIZE (1L << 20)     // read pipeline: bytes per read
+#define IO_DEFAULT_INFLIGHT 32       // read pipeline: reads kept in flight unless overridden
+#define WRITER_BUFFER_SIZE (64 * 1024)  // output is flushed in blocks of this size
+#define DEFAULT_MAX_HITS 100000          // detections kept per scanned file unless overridden
+#define COMPILED_VERSION 2           // bumped whenever the layout of a compiled database changes
+#define JOURNAL_VERSION 2
+#define SIG_PATTERN 0x0001           // record flag (VIML/VIMB only): the body is a pattern in text form
+#define HASH_PREFIX 4                // bytes of a signature the hash engine indexes
+#define PATCH_MMAP_MIN 64            // fixes with at least this many patches go through a shared mapping
+#define CACHE_VERSION 1
+#define CACHE_MIN_SLOTS 1024         // initial size of a verdict cache table
+
+// One signature record. Its bytes live in the owning sig_db at bytes + offset.
+// For a masked signature those bytes are only its anchor, the longest run of fixed bytes,
+// and the compiled pattern sits in front of them.
+typedef struct virus {
+    unsigned int offset;
+    unsigned short SigSize;
+    char virusName[16];
+    unsigned short pattern;  // 0 for a plain signature, else distance back from offset to the pattern
+} virus;
+
+typedef struct virus_location {
+    long offset;
+    unsigned short size;
+    char name[16];
+} virus_location;
+
+// Growable list of detections filled by the matchers. Resetting keeps the allocation,
+// so one result can be reused across scans.
+typedef struct scan_result {
+    virus_location* locations;
+    int count;
+    int capacity;
+    int max_hits;  // detections kept, 0 for no limit; later ones are only counted
+    long total;    // every detection seen, including those over the cap
+    int dropped;   // detections lost because the list could not grow
+} scan_result;
+
+// Buffered output for detection reports, as text or as JSON lines. Numbers and
+// strings are formatted by hand so a large report costs no per-field stdio calls.
+typedef struct out_writer {
+    FILE* file;
+    int json;
+    size_t len;
+    char buf[WRITER_BUFFER_SIZE];
+} out_writer;
+
+// Undo journal: one block per fixed file, a header followed by the absolute path and
+// the original byte of every patched offset. Written before the file is touched. The
+// file's identity and size are recorded so undo never patches a different file.
+typedef struct journal_header {
+    char magic[4];  // "VIRU"
+    unsigned int version;
+    unsigned int path_len;
+    unsigned int count;
+    unsigned long long size;
+    unsigned long long dev;
+    unsigned long long ino;
+} journal_header;
+
+typedef struct journal_entry {
+    unsigned long long offset;
+    unsigned char original;
+    unsigned char pad[7];
+} journal_entry;
+
+// Settings of the non-interactive scan modes
+typedef struct scan_options {
+    int num_threads;
+    int json;
+    int max_hits;
+    char* cache_path;  // verdict cache file, NULL to scan everything
+    int cache_digest;  // also require the content digest of a cached file to match
+    int io;            // how file contents reach the matcher, one of IO_*
+    int inflight;      // read pipeline: reads in flight at once
+#ifdef AV_PROFILE
+    char* profile_path;  // where the profile is written after the scan, NULL for none
+#endif
+} scan_options;
+
+// IO_MMAP maps every file in the matching threads. The others read chunks ahead into
+// buffers through io_uring or through reader threads, and the matching threads only match.
+enum { IO_MMAP, IO_URING, IO_THREADS };
+
+#ifdef AV_PROFILE
+// Profiling build (-DAV_PROFILE): per-signature counters kept by each thread. A candidate
+// is the engine reaching a signature at some position, a comparison is the check made there
+// (a memcmp, a pattern check, or for the automaton the output check of a plain signature
+// whose bytes the automaton already matched), and a hit is a reported detection.
+typedef struct sig_profile {
+    unsigned long candidates;
+    unsigned long comparisons;
+    unsigned long hits;
+} sig_profile;
+
+// One thread's counters for one database. Blocks are registered on first use and outlive
+// their thread, so a report can merge them after the workers have exited.
+typedef struct profile_block {
+    const void* db;
+    int count;
+    sig_profile* counters;
+    struct profile_block* next;
+} profile_block;
+
+profile_block* profile_blocks = NULL;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread profile_block* thread_profile = NULL;
+#endif
+
+// Aho-Corasick automaton over every loaded signature, compiled once in load_signatures
+typedef struct ac_node {
+    int fail;        // state to fall back to on a mismatch
+    int out;         // first entry in outputs of a signature ending here, -1 if none
+    int dict;        // nearest state on the fail chain that has an output, -1 if none
+    int first_edge;  // outgoing edges are edges[first_edge .. first_edge + num_edges), sorted by byte
+    int num_edges;
+    int dense;       // row in dense_next for states with many edges, -1 otherwise
+} ac_node;
+
+typedef struct ac_edge {
+    unsigned char byte;
+    int target;
+} ac_edge;
+
+typedef struct ac_output {
+    int sig;   // index into sig_db.viruses
+    int next;
+} ac_output;
+
+typedef struct ac_automaton {
+    ac_node* nodes;
+    int num_nodes;
+    ac_edge* edges;
+    ac_output* outputs;
+    int num_outputs;
+    int* dense_next;     // 256-entry rows of direct transitions, -1 where there is no edge
+    int num_dense;
+    int root_next[256];  // dense transitions out of the root state
+} ac_automaton;
+
+// First-byte prefilter: while the automaton sits in its root state, every match must have
+// one of bytes[] at offset shift from its start (followed by next when has_next is set),
+// so the scan can jump straight to the next such position
+typedef struct prefilter {
+    int num_bytes;           // 0 disables the prefilter
+    unsigned char bytes[3];  // unused slots repeat bytes[0]
+    int has_next;
+    unsigned char next;
+    unsigned int shift;
+} prefilter;
+
+// Compiled masked signature: this header, a pattern_segment per run of bytes, then the
+// values and masks of every segment and a copy of the anchor. All fields are read with
+// memcpy since the arena gives no alignment.
+typedef struct pattern_header {
+    unsigned short num_segments;
+    unsigned short anchor_segment;  // segment holding the anchor
+    unsigned short anchor_start;    // position of the anchor within that segment
+    unsigned short min_size;        // bytes covered by a match, depending on the gaps taken
+    unsigned short max_size;
+} pattern_header;
+
+typedef struct pattern_segment {
+    unsigned short size;
+    unsigned short gap_min;  // arbitrary bytes between the previous segment and this one
+    unsigned short gap_max;
+    unsigned short data;     // values at pattern + data, masks right after them
+} pattern_segment;
+
+// Rabin-Karp style index over the first HASH_PREFIX bytes of every signature that long.
+// The rolling window at each offset costs one probe of the open-addressed table.
+typedef struct hash_index {
+    unsigned int* keys;  // prefix stored in each slot
+    int* heads;          // first signature with that prefix, -1 for an empty slot
+    int* next;           // per signature: next one with the same prefix, -1 at the end
+    unsigned int mask;
+    int* short_sigs;     // signatures shorter than HASH_PREFIX, compared at every offset
+    int num_short;
+} hash_index;
+
+enum { ENGINE_AHO, ENGINE_HASH, ENGINE_NAIVE };
+
+// Signature database: every signature's bytes back to back in one arena, plus a dense
+// array of records pointing into it and the automaton compiled from them
+typedef struct sig_db {
+    virus* viruses;
+    int count;
+    int capacity;
+    unsigned char* bytes;
+    size_t num_bytes;
+    size_t bytes_capacity;
+    unsigned short max_size;  // longest signature, sets the overlap between scanned chunks
+    int num_patterns;         // masked signatures among the records
+    ac_automaton matcher;     // empty when compilation failed, the naive matcher is used then
+    prefilter filter;         // derived from the automaton at load time, never stored
+    hash_index index;         // built at load time for the hash engine only
+    void* map;                // compiled database the arrays above point into, NULL if they are heap-owned
+    size_t map_size;
+} sig_db;
+
+// Header of a compiled ("VIRC") database written by compile-sigs. All fields are
+// little-endian and every section starts at an 8-byte aligned offset from the file start,
+// so a mapping of the file is used as is.
+typedef struct compiled_header {
+    char magic[4];
+    unsigned int version;
+    unsigned int count;
+    unsigned int max_size;
+    unsigned int num_nodes;
+    unsigned int num_outputs;
+    unsigned int num_dense;
+    unsigned int num_patterns;
+    unsigned long long num_bytes;
+    unsigned long long viruses_offset;
+    unsigned long long bytes_offset;
+    unsigned long long nodes_offset;
+    unsigned long long edges_offset;
+    unsigned long long outputs_offset;
+    unsigned long long dense_offset;
+    int root_next[256];
+} compiled_header;
+
+// The compiled format stores these structs verbatim
+_Static_assert(sizeof(virus) == 24, "virus record layout changed");
+_Static_assert(sizeof(ac_node) == 24, "ac_node layout changed");
+_Static_assert(sizeof(ac_edge) == 8, "ac_edge layout changed");
+_Static_assert(sizeof(ac_output) == 8, "ac_output layout changed");
+
+// Directory scan: one regular file found under the scanned directory
+typedef struct scan_target {
+    char* path;
+    long size;
+    int failed;
+    int cached;  // a still valid clean verdict was found in the cache, so it is not read
+    unsigned long long dev;
+    unsigned long long ino;
+    long long mtime_sec;
+    long long mtime_nsec;
+} scan_target;
+
+// Verdict cache ("VIRK"): files that scanned clean, keyed on their identity and tagged with
+// the fingerprint of the signatures they were scanned with. The file is a header followed
+// by an open-addressed table of num_slots entries and is used through a shared mapping.
+// Files with detections are never cached, they are rescanned to report their locations.
+typedef struct cache_header {
+    char magic[4];
+    unsigned int version;
+    unsigned long long db_version;
+    unsigned int num_slots;  // power of two
+    unsigned int count;
+    unsigned long long hits;    // lifetime counters, updated when the cache is closed
+    unsigned long long misses;
+} cache_header;
+
+typedef struct cache_entry {
+    unsigned long long dev;
+    unsigned long long ino;  // 0 marks an empty slot
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long digest;  // content digest, 0 if it was not computed
+} cache_entry;
+
+typedef struct verdict_cache {
+    int fd;
+    cache_header* hdr;
+    cache_entry* slots;
+    size_t map_size;
+    time_t opened;
+    long hits;    // this run only
+    long misses;
+} verdict_cache;
+
+// Directory scan: bytes [start, end) of one target, the unit handed to workers
+typedef struct scan_piece {
+    int target;
+    long start;
+    long end;
+#ifdef AV_PROFILE
+    double seconds;  // spent matching this piece
+#endif
+} scan_piece;
+
+// Directory scan: state shared by all workers. Everything but next_piece is read-only.
+typedef struct scan_job {
+    scan_target* targets;
+    int num_targets;
+    scan_piece* pieces;
+    int num_pieces;
+    scan_result* results;  // one per piece
+    sig_db* db;
+    int max_hits;
+    int next_piece;
+    pthread_mutex_t lock;
+} scan_job;
+
+// Read pipeline: one chunk of a target read into memory, overlap bytes of it repeating
+// the end of the previous chunk
+typedef struct io_buffer {
+    int piece;
+    long base;             // file offset of data[0]
+    long length;
+    long done;             // bytes read so far
+    unsigned int overlap;
+    int error;
+    unsigned char* data;
+    struct iovec iov;      // io_uring reads go through readv
+} io_buffer;
+
+#ifdef HAVE_IO_URING
+// io_uring instance driven through the raw system calls and its shared rings
+typedef struct io_ring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    void* cq_map;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+} io_ring;
+#endif
+
+// Read pipeline: buffers cycle from the free stack to a reader, through the queue of
+// filled buffers to a matching thread, and back. The pool bounds both reads in flight
+// and buffers waiting to be matched.
+typedef struct io_pipeline {
+    scan_job* job;
+    io_buffer* buffers;
+    int num_buffers;
+    int* free;           // stack of free buffers
+    int num_free;
+    int* queue;          // ring of filled buffers in the order they completed
+    int queue_head;
+    int queue_count;
+    int readers_left;    // readers still running; the queue ends when they are all done
+    int next_target;     // reader threads: next target to claim
+    int* first_piece;    // per target, -1 if it has no pieces
+    int* fds;            // io_uring reader: per target, open while it has reads pending
+    int* reads_left;     // io_uring reader: per target, pieces not read yet
+    unsigned int keep;   // bytes of the previous chunk read again in front of each chunk
+    int inflight;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#ifdef HAVE_IO_URING
+    io_ring ring;
+#endif
+} io_pipeline;
+
+#define AC_DENSE_MIN_EDGES 32  // states with at least this many edges get a dense row
+
+// Trie edge used only while the automaton is being built
+typedef struct ac_build_edge {
+    unsigned char byte;
+    int target;
+    int next;
+} ac_build_edge;
+
+int is_little_endian = 1;  // Default to little endian
+int has_record_flags = 0;  // VIML/VIMB records carry a flags word after their size
+int scan_engine = ENGINE_AHO;  // matcher used by scan_chunk, chosen with --engine
+
+// Function declarations
+int readVirus(FILE* file, sig_db* db);
+void printVirus(sig_db* db, virus* virus, FILE* output);
+int checkMagicNumber(FILE* file);
+void list_print(sig_db* db, FILE* output);
+int list_append(sig_db* db, virus* data, unsigned char* sig);
+void list_free(sig_db* db);
+sig_db* load_signatures(char* filename);
+sig_db* load_compiled(char* filename);
+int compile_signatures(sig_db* db, char* filename);
+void print_menu();
+int ac_build(ac_automaton* ac, sig_db* db);
+void ac_free(ac_automaton* ac);
+void detect_virus(char *buffer, unsigned int size, sig_db* db, scan_result* result);
+void detect_virus_naive(char *buffer, unsigned int size, sig_db* db, scan_result* result);
+void scan_chunk(unsigned char* buffer, unsigned int size, long base, unsigned int overlap, sig_db* db, scan_result* result);
+int scan_file(char* fileName, sig_db* db, scan_result* result);
+int scan_mapped(FILE* file, long start, long end, sig_db* db, scan_result* result);
+int scan_stream(FILE* file, sig_db* db, scan_result* result);
+void print_detections(scan_result* result);
+void write_detection(out_writer* w, const char* path, virus_location* loc);
+void writer_flush(out_writer* w);
+void prefilter_build(sig_db* db);
+int hash_build(hash_index* index, sig_db* db);
+void hash_free(hash_index* index);
+void prepare_engines(sig_db* db);
+int scan_directory(char* dirName, sig_db* db, scan_options* options);
+int scan_targets(scan_target* targets, int num_targets, sig_db* db, scan_options* options);
+void neutralize_virus(char *fileName, long signatureOffset);
+int neutralize_viruses(char* fileName, scan_result* result, FILE* journal);
+int undo_journal(char* journalName);
+int add_scan_target(scan_target** targets, int* count, int* capacity, char* path, struct stat* st);
+unsigned char* pattern_compile(const char* text, int len, sig_db* db, virus* v);
+
+
+unsigned short convert_endian(unsigned short num) {
+    if (is_little_endian) {
+        return num;
+    }
+    return (num >> 8) | (num << 8);  // Swap bytes for big endian
+}
+
+// Makes room for size more bytes at the end of the arena and returns where they go,
+// or NULL if it cannot grow. Nothing is committed until list_append. The arena is
+// allocated even for size 0, since callers take NULL as failure.
+unsigned char* arena_reserve(sig_db* db, size_t size) {
+    if (db->bytes == NULL || db->num_bytes + size > db->bytes_capacity) {
+        size_t capacity = db->bytes_capacity ? db->bytes_capacity * 2 : 4096;
+        while (capacity < db->num_bytes + size) capacity *= 2;
+        unsigned char* grown = realloc(db->bytes, capacity);
+        if (grown == NULL) return NULL;
+        db->bytes = grown;
+        db->bytes_capacity = capacity;
+    }
+    return db->bytes + db->num_bytes;
+}
+
+// Reads one record straight into the database arena. Returns 0 at end of file or on error.
+// VIRL/VIRB records are a size, a name and the signature bytes, so any size up to 65535 is
+// a plain signature. VIML/VIMB records add a flags word after the size; one with
+// SIG_PATTERN set holds a masked signature as text, see pattern_compile.
+int readVirus(FILE* file, sig_db* db) {
+    virus v;
+    unsigned short size, flags = 0;
+    if (fread(&size, sizeof(unsigned short), 1, file) != 1) {
+        return 0;
+    }
+    v.SigSize = convert_endian(size);
+    v.pattern = 0;
+    if (has_record_flags) {
+        if (fread(&flags, sizeof(unsigned short), 1, file) != 1) {
+            return 0;
+        }
+        flags = convert_endian(flags);
+    }
+    
+    if (fread(v.virusName, sizeof(char), 16, file) != 16) {
+        return 0;
+    }
+
+    if (flags & ~SIG_PATTERN) {
+        printf("Unknown flags in signature %.16s, skipped\n", v.virusName);
+        return fseek(file, v.SigSize, SEEK_CUR) == 0;
+    }
+    if (flags & SIG_PATTERN) {
+        int len = v.SigSize;
+        char* text = malloc(len + 1);
+        if (text == NULL || fread(text, 1, len, file) != len) {
+            free(text);
+            return 0;
+        }
+        unsigned char* anchor = pattern_compile(text, len, db, &v);
+        free(text);
+        if (anchor == NULL) {
+            printf("Invalid pattern in signature %.16s, skipped\n", v.virusName);
+            return 1;
+        }
+        return list_append(db, &v, anchor);
+    }
+    
+    // Read into the spare tail of the arena; list_append commits it
+    unsigned char* sig = arena_reserve(db, v.SigSize);
+    if (sig == NULL || fread(sig, sizeof(unsigned char), v.SigSize, file) != v.SigSize) {
+        return 0;
+    }
+    
+    return list_append(db, &v, sig);
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Parses a decimal gap bound at text[*i]. Returns -1 if there is none or it is too large.
+long parse_gap_bound(const char* text, int len, int* i) {
+    long n = -1;
+    while (*i < len && text[*i] >= '0' && text[*i] <= '9') {
+        n = (n < 0 ? 0 : n * 10) + text[(*i)++] - '0';
+        if (n > 0xFFFF) return -1;
+    }
+    return n;
+}
+
+// Compiles the text form of a masked signature into the arena. The text is a list of hex
+// bytes where "??" matches any byte, "4?" and "?A" match one nibble, and "{n}" or "{n-m}"
+// between two bytes skips n to m arbitrary bytes. The longest run of fully fixed bytes
+// becomes the anchor that the engines search for like a plain signature. Fills in v and
+// returns the anchor, or NULL if the text is invalid or the pattern is too large.
+unsigned char* pattern_compile(const char* text, int len, sig_db* db, virus* v) {
+    // Every byte token takes two characters and every gap at least three
+    unsigned char* values = malloc(len / 2 + 1);
+    unsigned char* masks = malloc(len / 2 + 1);
+    pattern_segment* segs = malloc((len / 3 + 1) * sizeof(pattern_segment));
+    unsigned char* anchor = NULL;
+    int num_bytes = 0, num_segs = 0;
+    long gap_min = 0, gap_max = 0;
+    int in_gap = 0, valid = values && masks && segs;
+
+    for (int i = 0; valid && i < len; ) {
+        char c = text[i];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            i++;
+        } else if (c == '{') {
+            i++;
+            long lo = parse_gap_bound(text, len, &i), hi = lo;
+            if (i < len && text[i] == '-') {
+                i++;
+                hi = parse_gap_bound(text, len, &i);
+            }
+            valid = num_segs > 0 && lo >= 0 && hi >= lo && i < len && text[i] == '}';
+            i++;
+            gap_min += lo;
+            gap_max += hi;
+            in_gap = 1;
+        } else if (i + 1 < len) {
+            int hi = hex_digit(c), lo = hex_digit(text[i + 1]);
+            valid = (hi >= 0 || c == '?') && (lo >= 0 || text[i + 1] == '?');
+            if (!valid) break;
+            if (num_segs == 0 || in_gap) {
+                valid = gap_max <= 0xFFFF;
+                segs[num_segs++] = (pattern_segment){0, gap_min, gap_max, num_bytes};
+                gap_min = gap_max = 0;
+                in_gap = 0;
+            }
+            masks[num_bytes] = (hi >= 0 ? 0xF0 : 0) | (lo >= 0 ? 0x0F : 0);
+            values[num_bytes] = ((hi >= 0 ? hi : 0) << 4 | (lo >= 0 ? lo : 0));
+            num_bytes++;
+            segs[num_segs - 1].size++;
+            i += 2;
+        } else {
+            valid = 0;
+        }
+    }
+    if (in_gap) valid = 0;
+
+    // Anchor on the longest run of fixed bytes; the pattern must have at least one
+    int best_seg = -1, best_start = 0, best_len = 0;
+    unsigned long min_size = 0, max_size = 0;
+    for (int j = 0; valid && j < num_segs; j++) {
+        int run = 0;
+        for (int k = 0; k < segs[j].size; k++) {
+            run = masks[segs[j].data + k] == 0xFF ? run + 1 : 0;
+            if (run > best_len) {
+                best_len = run;
+                best_seg = j;
+                best_start = k - run + 1;
+            }
+        }
+        min_size += segs[j].gap_min + segs[j].size;
+        max_size += segs[j].gap_max + segs[j].size;
+    }
+    size_t header = sizeof(pattern_header) + num_segs * sizeof(pattern_segment);
+    size_t total = header + 2 * num_bytes + best_len;
+    if (valid && best_seg >= 0 && best_len <= 0xFFFF && max_size <= 0xFFFF && total <= 0xFFFF) {
+        unsigned char* prog = arena_reserve(db, total);
+        if (prog != NULL) {
+            pattern_header h = {num_segs, best_seg, best_start, min_size, max_size};
+            memcpy(prog, &h, sizeof(h));
+            unsigned char* data = prog + header;
+            for (int j = 0; j < num_segs; j++) {
+                pattern_segment seg = segs[j];
+                seg.data = data - prog;
+                memcpy(data, values + segs[j].data, seg.size);
+                memcpy(data + seg.size, masks + segs[j].data, seg.size);
+                memcpy(prog + sizeof(pattern_header) + j * sizeof(pattern_segment), &seg, sizeof(seg));
+                data += 2 * seg.size;
+            }
+            memcpy(data, values + segs[best_seg].data + best_start, best_len);
+            anchor = data;
+            v->SigSize = best_len;
+            v->pattern = anchor - prog;
+        }
+    }
+
+    free(values);
+    free(masks);
+    free(segs);
+    return anchor;
+}
+
+// The compiled pattern of a masked signature
+static inline const unsigned char* pattern_of(sig_db* db, virus* v) {
+    return db->bytes + v->offset - v->pattern;
+}
+
+static inline void pattern_segment_at(const unsigned char* prog, int j, pattern_segment* seg) {
+    memcpy(seg, prog + sizeof(pattern_header) + j * sizeof(pattern_segment), sizeof(*seg));
+}
+
+int pattern_segment_matches(const unsigned char* prog, const pattern_segment* seg,
+        const unsigned char* buffer, long pos, unsigned int size) {
+    if (pos < 0 || pos + seg->size > size) return 0;
+    const unsigned char* values = prog + seg->data;
+    const unsigned char* masks = values + seg->size;
+    for (int k = 0; k < seg->size; k++) {
+        if ((buffer[pos + k] & masks[k]) != values[k]) return 0;
+    }
+    return 1;
+}
+
+// Places segments j-1 down to 0 in front of segment j, which starts at start, taking the
+// shortest gaps that fit. Returns where segment 0 starts, or -1 if they do not fit.
+long pattern_match_before(const unsigned char* prog, int j, long start, const unsigned char* buffer, unsigned int size) {
+    if (j == 0) return start;
+    pattern_segment seg, prev;
+    pattern_segment_at(prog, j, &seg);
+    pattern_segment_at(prog, j - 1, &prev);
+    for (long gap = seg.gap_min; gap <= seg.gap_max; gap++) {
+        long pos = start - gap - prev.size;
+        if (pos < 0) break;
+        if (pattern_segment_matches(prog, &prev, buffer, pos, size)) {
+            long first = pattern_match_before(prog, j - 1, pos, buffer, size);
+            if (first >= 0) return first;
+        }
+    }
+    return -1;
+}
+
+// Places segments after segment j, which ends at end, taking the shortest gaps that fit.
+// Returns where the last segment ends, or -1 if they do not fit.
+long pattern_match_after(const unsigned char* prog, int num_segs, int j, long end, const unsigned char* buffer, unsigned int size) {
+    if (j == num_segs - 1) return end;
+    pattern_segment next;
+    pattern_segment_at(prog, j + 1, &next);
+    for (long gap = next.gap_min; gap <= next.gap_max; gap++) {
+        long pos = end + gap;
+        if (pos + next.size > size) break;
+        if (pattern_segment_matches(prog, &next, buffer, pos, size)) {
+            long last = pattern_match_after(prog, num_segs, j + 1, pos + next.size, buffer, size);
+            if (last >= 0) return last;
+        }
+    }
+    return -1;
+}
+
+void print_pattern(const unsigned char* prog, FILE* output) {
+    pattern_header h;
+    memcpy(&h, prog, sizeof(h));
+    for (int j = 0; j < h.num_segments; j++) {
+        pattern_segment seg;
+        pattern_segment_at(prog, j, &seg);
+        if (j > 0 && seg.gap_min == seg.gap_max) fprintf(output, "{%d} ", seg.gap_min);
+        else if (j > 0) fprintf(output, "{%d-%d} ", seg.gap_min, seg.gap_max);
+        const unsigned char* values = prog + seg.data;
+        const unsigned char* masks = values + seg.size;
+        for (int k = 0; k < seg.size; k++) {
+            if (masks[k] == 0xFF) fprintf(output, "%02X ", values[k]);
+            else if (masks[k] == 0xF0) fprintf(output, "%X? ", values[k] >> 4);
+            else if (masks[k] == 0x0F) fprintf(output, "?%X ", values[k] & 0x0F);
+            else fprintf(output, "?? ");
+        }
+    }
+}
+
+void printVirus(sig_db* db, virus* virus, FILE* output) {
+    if (!virus || !output) return;
+    
+    const unsigned char* sig = db->bytes + virus->offset;
+    fprintf(output, "Virus name: %.16s\n", virus->virusName);
+    if (virus->pattern != 0) {
+        pattern_header h;
+        memcpy(&h, pattern_of(db, virus), sizeof(h));
+        if (h.min_size == h.max_size) fprintf(output, "Virus size: %d\n", h.max_size);
+        else fprintf(output, "Virus size: %d-%d\n", h.min_size, h.max_size);
+        fprintf(output, "signature: ");
+        print_pattern(pattern_of(db, virus), output);
+        fprintf(output, "\n\n");
+        return;
+    }
+    fprintf(output, "Virus size: %d\n", virus->SigSize);
+    fprintf(output, "signature: ");
+    
+    for (int i = 0; i < virus->SigSize; i++) {
+        fprintf(output, "%02X ", sig[i]);
+    }
+    fprintf(output, "\n\n");
+}
+
+int checkMagicNumber(FILE* file) {
+    char magic[4];
+    if (fread(magic, 1, 4, file) != 4) return 0;
+    
+    // L/B: little or big endian; VIM files may also hold masked signatures
+    if (memcmp(magic, "VIRL", 4) == 0 || memcmp(magic, "VIML", 4) == 0) {
+        is_little_endian = 1;
+        has_record_flags = magic[2] == 'M';
+        return 1;
+    }
+    if (memcmp(magic, "VIRB", 4) == 0 || memcmp(magic, "VIMB", 4) == 0) {
+        is_little_endian = 0;
+        has_record_flags = magic[2] == 'M';
+        return 1;
+    }
+    if (memcmp(magic, "VIRC", 4) == 0) {
+        return 2;
+    }
+    return 0;
+}
+
+int ac_compare_edges(const void* a, const void* b) {
+    return ((const ac_edge*)a)->byte - ((const ac_edge*)b)->byte;
+}
+
+// Returns the child of state on byte c, or -1 if there is none
+int ac_find_edge(const ac_automaton* ac, int state, unsigned char c) {
+    const ac_node* n = &ac->nodes[state];
+    if (n->dense >= 0) return ac->dense_next[n->dense * 256 + c];
+    const ac_edge* e = ac->edges + n->first_edge;
+    if (n->num_edges <= 8) {
+        for (int i = 0; i < n->num_edges; i++) {
+            if (e[i].byte == c) return e[i].target;
+        }
+        return -1;
+    }
+    int lo = 0, hi = n->num_edges - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (e[mid].byte == c) return e[mid].target;
+        if (e[mid].byte < c) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+// Goto/fail transition: follow fail links until some state has an edge on c
+static inline int ac_next(const ac_automaton* ac, int state, unsigned char c) {
+    while (state != 0) {
+        int t = ac_find_edge(ac, state, c);
+        if (t >= 0) return t;
+        state = ac->nodes[state].fail;
+    }
+    return ac->root_next[c];
+}
+
+void ac_free(ac_automaton* ac) {
+    free(ac->nodes);
+    free(ac->edges);
+    free(ac->outputs);
+    free(ac->dense_next);
+    memset(ac, 0, sizeof(ac_automaton));
+}
+
+// Compiles all signatures into one automaton. Returns 0 on success, -1 on allocation failure.
+int ac_build(ac_automaton* ac, sig_db* db) {
+    memset(ac, 0, sizeof(ac_automaton));
+
+    size_t max_nodes = 1 + db->num_bytes, num_sigs = db->count;
+
+    int* head = malloc(max_nodes * sizeof(int));
+    ac_build_edge* trie = malloc(max_nodes * sizeof(ac_build_edge));
+    int* queue = malloc(max_nodes * sizeof(int));
+    ac->nodes = malloc(max_nodes * sizeof(ac_node));
+    ac->edges = malloc(max_nodes * sizeof(ac_edge));
+    ac->outputs = malloc((num_sigs + 1) * sizeof(ac_output));
+    if (!head || !trie || !queue || !ac->nodes || !ac->edges || !ac->outputs) {
+        free(head);
+        free(trie);
+        free(queue);
+        ac_free(ac);
+        return -1;
+    }
+
+    // Build the trie, keeping the root's children in root_next for constant-time lookup
+    int num_trie_edges = 0;
+    for (int c = 0; c < 256; c++) ac->root_next[c] = -1;
+    ac->nodes[0] = (ac_node){0, -1, -1, 0, 0, -1};
+    head[0] = -1;
+    ac->num_nodes = 1;
+
+    for (int n = 0; n < db->count; n++) {
+        virus* v = &db->viruses[n];
+        const unsigned char* sig = db->bytes + v->offset;
+        if (v->SigSize == 0) continue;
+
+        int state = 0;
+        for (int i = 0; i < v->SigSize; i++) {
+            unsigned char c = sig[i];
+            int child = -1;
+            if (state == 0) {
+                child = ac->root_next[c];
+            } else {
+                for (int e = head[state]; e != -1; e = trie[e].next) {
+                    if (trie[e].byte == c) {
+                        child = trie[e].target;
+                        break;
+                    }
+                }
+            }
+            if (child == -1) {
+                child = ac->num_nodes++;
+                ac->nodes[child] = (ac_node){0, -1, -1, 0, 0, -1};
+                head[child] = -1;
+                trie[num_trie_edges] = (ac_build_edge){c, child, head[state]};
+                head[state] = num_trie_edges++;
+                if (state == 0) ac->root_next[c] = child;
+            }
+            state = child;
+        }
+
+        ac->outputs[ac->num_outputs] = (ac_output){n, ac->nodes[state].out};
+        ac->nodes[state].out = ac->num_outputs++;
+    }
+
+    // Pack each state's edges into one sorted run
+    int num_edges = 0;
+    for (int n = 0; n < ac->num_nodes; n++) {
+        ac->nodes[n].first_edge = num_edges;
+        for (int e = head[n]; e != -1; e = trie[e].next) {
+            ac->edges[num_edges++] = (ac_edge){trie[e].byte, trie[e].target};
+        }
+        ac->nodes[n].num_edges = num_edges - ac->nodes[n].first_edge;
+        qsort(ac->edges + ac->nodes[n].first_edge, ac->nodes[n].num_edges, sizeof(ac_edge), ac_compare_edges);
+        if (n != 0 && ac->nodes[n].num_edges >= AC_DENSE_MIN_EDGES) ac->num_dense++;
+    }
+    free(head);
+    free(trie);
+
+    // Wide states (typically the first levels of a large signature set) get direct lookup rows
+    if (ac->num_dense > 0) {
+        ac->dense_next = malloc((size_t)ac->num_dense * 256 * sizeof(int));
+        if (ac->dense_next == NULL) {
+            free(queue);
+            ac_free(ac);
+            return -1;
+        }
+        int row = 0;
+        for (int n = 1; n < ac->num_nodes; n++) {
+            ac_node* node = &ac->nodes[n];
+            if (node->num_edges < AC_DENSE_MIN_EDGES) continue;
+            int* next = ac->dense_next + (size_t)row * 256;
+            for (int c = 0; c < 256; c++) next[c] = -1;
+            for (int e = node->first_edge; e < node->first_edge + node->num_edges; e++) {
+                next[ac->edges[e].byte] = ac->edges[e].target;
+            }
+            node->dense = row++;
+        }
+    }
+
+    // Breadth-first pass computing fail and dictionary links
+    int q_head = 0, q_tail = 0;
+    queue[q_tail++] = 0;
+    while (q_head < q_tail) {
+        int u = queue[q_head++];
+        const ac_node* un = &ac->nodes[u];
+        for (int e = un->first_edge; e < un->first_edge + un->num_edges; e++) {
+            unsigned char c = ac->edges[e].byte;
+            int v = ac->edges[e].target;
+            int fail = 0;
+            if (u != 0) {
+                int f = un->fail;
+                while (1) {
+                    int t = (f == 0) ? ac->root_next[c] : ac_find_edge(ac, f, c);
+                    if (t >= 0) {
+                        fail = t;
+                        break;
+                    }
+                    if (f == 0) break;
+                    f = ac->nodes[f].fail;
+                }
+            }
+            ac->nodes[v].fail = fail;
+            ac->nodes[v].dict = ac->nodes[fail].out >= 0 ? fail : ac->nodes[fail].dict;
+            queue[q_tail++] = v;
+        }
+    }
+    free(queue);
+
+    for (int c = 0; c < 256; c++) {
+        if (ac->root_next[c] == -1) ac->root_next[c] = 0;
+    }
+    return 0;
+}
+
+// Checks every index stored in an automaton that was mapped from a file, so ac_next and
+// ac_scan can follow them without bounds checks. Edges lead from a state to a newer one
+// that no other edge reaches, lookup rows match the edges, fail and dictionary links lead
+// to shallower states, output chains only run backwards and every output sits at the
+// depth of its signature's size, so no match can start before the scanned buffer.
+// Returns 1 if the automaton is usable.
+int ac_validate(const ac_automaton* ac, sig_db* db) {
+    int num_edges = ac->num_nodes - 1;
+    int* depth = malloc(ac->num_nodes * sizeof(int));
+    if (depth == NULL) return 0;
+    for (int n = 0; n < ac->num_nodes; n++) depth[n] = -1;
+    depth[0] = 0;
+
+    int valid = 1;
+    for (int n = 0; valid && n < ac->num_nodes; n++) {
+        const ac_node* node = &ac->nodes[n];
+        valid = depth[n] >= 0 && node->first_edge >= 0 && node->num_edges >= 0 &&
+            node->num_edges <= num_edges - node->first_edge &&
+            node->out >= -1 && node->out < ac->num_outputs &&
+            node->dense >= -1 && node->dense < ac->num_dense;
+        for (int e = node->first_edge; valid && e < node->first_edge + node->num_edges; e++) {
+            int t = ac->edges[e].target;
+            valid = t > n && t < ac->num_nodes && depth[t] < 0;
+            if (valid) depth[t] = depth[n] + 1;
+        }
+    }
+    for (int n = 0; valid && n < ac->num_nodes; n++) {
+        const ac_node* node = &ac->nodes[n];
+        valid = node->fail >= 0 && node->fail < ac->num_nodes &&
+            (n == 0 ? node->fail == 0 : depth[node->fail] < depth[n]) &&
+            (node->dict == -1 || (node->dict > 0 && node->dict < ac->num_nodes && depth[node->dict] < depth[n]));
+        for (int o = node->out; valid && o != -1; o = ac->outputs[o].next) {
+            const ac_output* out = &ac->outputs[o];
+            valid = out->sig >= 0 && out->sig < db->count && db->viruses[out->sig].SigSize == depth[n] &&
+                out->next >= -1 && out->next < o;
+        }
+    }
+    // Direct lookup rows must agree with the edges they stand for
+    for (int n = 0; valid && n < ac->num_nodes; n++) {
+        const ac_node* node = &ac->nodes[n];
+        if (n != 0 && node->dense < 0) continue;
+        int expected[256];
+        for (int c = 0; c < 256; c++) expected[c] = n == 0 ? 0 : -1;
+        for (int e = node->first_edge; e < node->first_edge + node->num_edges; e++) {
+            expected[ac->edges[e].byte] = ac->edges[e].target;
+        }
+        const int* row = n == 0 ? ac->root_next : ac->dense_next + (size_t)node->dense * 256;
+        valid = memcmp(row, expected, sizeof(expected)) == 0;
+    }
+    free(depth);
+    return valid;
+}
+
+void reset_result(scan_result* result, int max_hits) {
+    result->count = 0;
+    result->max_hits = max_hits;
+    result->total = 0;
+    result->dropped = 0;
+}
+
+void report_location(scan_result* result, virus_location* loc) {
+    result->total++;
+    if (result->max_hits > 0 && result->count >= result->max_hits) {
+        return;
+    }
+    if (result->count == result->capacity) {
+        int capacity = result->capacity ? result->capacity * 2 : 16;
+        virus_location* grown = realloc(result->locations, capacity * sizeof(virus_location));
+        if (grown == NULL) {
+            result->dropped++;
+            return;
+        }
+        result->locations = grown;
+        result->capacity = capacity;
+    }
+    result->locations[result->count++] = *loc;
+}
+
+#ifdef AV_PROFILE
+// Counters of the calling thread for db, registered on first use
+sig_profile* profile_attach(const void* db, int count) {
+    profile_block* block = calloc(1, sizeof(profile_block));
+    if (block == NULL || (block->counters = calloc(count, sizeof(sig_profile))) == NULL) {
+        fprintf(stderr, "Out of memory for profile counters\n");
+        exit(2);
+    }
+    block->db = db;
+    block->count = count;
+    pthread_mutex_lock(&profile_lock);
+    block->next = profile_blocks;
+    profile_blocks = block;
+    pthread_mutex_unlock(&profile_lock);
+    thread_profile = block;
+    return block->counters;
+}
+
+static inline sig_profile* profile_of(sig_db* db, virus* v) {
+    if (thread_profile == NULL || thread_profile->db != db) profile_attach(db, db->count);
+    return &thread_profile->counters[v - db->viruses];
+}
+
+double profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define PROFILE_COUNT(db, v, field) (profile_of(db, v)->field++)
+#else
+#define PROFILE_COUNT(db, v, field) ((void)0)
+#endif
+
+// Stores a detection for printing and later neutralization
+void report_virus(virus* v, long offset, scan_result* result) {
+    virus_location loc;
+    loc.offset = offset;
+    loc.size = v->SigSize;
+    memcpy(loc.name, v->virusName, 16);
+    report_location(result, &loc);
+}
+
+// The anchor of masked signature v was found at buffer[pos]. Reports the whole pattern if
+// the rest of it fits around the anchor and the match ends after the overlap.
+void pattern_report(sig_db* db, virus* v, const unsigned char* buffer, unsigned int size,
+        unsigned int pos, long base, unsigned int overlap, scan_result* result) {
+    const unsigned char* prog = pattern_of(db, v);
+    pattern_header h;
+    pattern_segment seg;
+    PROFILE_COUNT(db, v, comparisons);
+    memcpy(&h, prog, sizeof(h));
+    pattern_segment_at(prog, h.anchor_segment, &seg);
+
+    long seg_start = (long)pos - h.anchor_start;
+    if (!pattern_segment_matches(prog, &seg, buffer, seg_start, size)) return;
+    long end = pattern_match_after(prog, h.num_segments, h.anchor_segment, seg_start + seg.size, buffer, size);
+    if (end <= (long)overlap) return;
+    long start = pattern_match_before(prog, h.anchor_segment, seg_start, buffer, size);
+    if (start < 0) return;
+
+    virus_location loc;
+    loc.offset = base + start;
+    loc.size = end - start;
+    memcpy(loc.name, v->virusName, 16);
+    report_location(result, &loc);
+    PROFILE_COUNT(db, v, hits);
+}
+
+// The bytes of signature v were found at buffer[pos]: a detection if they end after the
+// overlap, or for a masked signature the anchor to check the rest of the pattern around
+static inline void report_found(sig_db* db, virus* v, const unsigned char* buffer, unsigned int size,
+        unsigned int pos, long base, unsigned int overlap, scan_result* result) {
+    if (v->pattern != 0) {
+        pattern_report(db, v, buffer, size, pos, base, overlap, result);
+    } else if (pos + v->SigSize > overlap) {
+        report_virus(v, base + pos, result);
+        PROFILE_COUNT(db, v, hits);
+    }
+}
+
+int compare_locations(const void* a, const void* b) {
+    const virus_location* x = a;
+    const virus_location* y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return strncmp(x->name, y->name, 16);
+}
+
+void writer_init(out_writer* w, FILE* file, int json) {
+    w->file = file;
+    w->json = json;
+    w->len = 0;
+}
+
+void writer_flush(out_writer* w) {
+    if (w->len > 0) fwrite(w->buf, 1, w->len, w->file);
+    w->len = 0;
+    fflush(w->file);
+}
+
+void writer_bytes(out_writer* w, const char* data, size_t len) {
+    while (len > 0) {
+        if (w->len == WRITER_BUFFER_SIZE) {
+            fwrite(w->buf, 1, w->len, w->file);
+            w->len = 0;
+        }
+        size_t n = WRITER_BUFFER_SIZE - w->len;
+        if (n > len) n = len;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void writer_str(out_writer* w, const char* str) {
+    writer_bytes(w, str, strlen(str));
+}
+
+void writer_long(out_writer* w, long value) {
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long v = value < 0 ? -(unsigned long)value : value;
+    do {
+        digits[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0) digits[--i] = '-';
+    writer_bytes(w, digits + i, sizeof(digits) - i);
+}
+
+// Writes at most max bytes of str as a quoted JSON string
+void writer_json_str(out_writer* w, const char* str, size_t max) {
+    static const char hex[] = "0123456789abcdef";
+    writer_bytes(w, "\"", 1);
+    for (size_t i = 0; i < max && str[i] != '\0'; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            char esc[2] = {'\\', c};
+            writer_bytes(w, esc, 2);
+        } else if (c < 0x20) {
+            char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            writer_bytes(w, esc, 6);
+        } else {
+            writer_bytes(w, (const char*)&c, 1);
+        }
+    }
+    writer_bytes(w, "\"", 1);
+}
+
+// One detection: a JSON object per line, a "path: offset" line for directory scans,
+// or the interactive menu's block when there is no path
+void write_detection(out_writer* w, const char* path, virus_location* loc) {
+    if (w->json) {
+        writer_str(w, "{");
+        if (path != NULL) {
+            writer_str(w, "\"path\":");
+            writer_json_str(w, path, (size_t)-1);
+            writer_str(w, ",");
+        }
+        writer_str(w, "\"offset\":");
+        writer_long(w, loc->offset);
+        writer_str(w, ",\"name\":");
+        writer_json_str(w, loc->name, 16);
+        writer_str(w, ",\"size\":");
+        writer_long(w, loc->size);
+        writer_str(w, "}\n");
+    } else if (path != NULL) {
+        writer_str(w, path);
+        writer_str(w, ": offset ");
+        writer_long(w, loc->offset);
+        writer_str(w, ": ");
+        writer_bytes(w, loc->name, strnlen(loc->name, 16));
+        writer_str(w, " (size ");
+        writer_long(w, loc->size);
+        writer_str(w, ")\n");
+    } else {
+        writer_str(w, "Virus detected!\nStarting byte location: ");
+        writer_long(w, loc->offset);
+        writer_str(w, "\nVirus name: ");
+        writer_bytes(w, loc->name, strnlen(loc->name, 16));
+        writer_str(w, "\nVirus size: ");
+        writer_long(w, loc->size);
+        writer_str(w, "\n\n");
+    }
+}
+
+void print_detections(scan_result* result) {
+    static out_writer w;
+    writer_init(&w, stdout, 0);
+    for (int i = 0; i < result->count; i++) {
+        write_detection(&w, NULL, &result->locations[i]);
+    }
+    writer_flush(&w);
+    if (result->total > result->count) {
+        printf("%ld viruses detected, only the first %d are listed\n", result->total, result->count);
+    }
+}
+
+// Rough frequency of a byte in executables and documents, used to pick the rarest
+// byte of a signature as its prefilter byte
+int byte_commonness(unsigned char c) {
+    switch (c) {
+        case 0x00: return 255;
+        case 0xFF: return 200;
+        case 0x48: case 0x89: case 0x8B: case 0xE8: case 0x0F: case 0x24: return 160;
+        case 0x20: case 0x65: case 0x74: case 0x61: case 0x6F: case 0x01: return 150;
+    }
+    if (c < 0x10) return 120;
+    if (c >= 0x20 && c < 0x7F) return 100;
+    return 40;
+}
+
+unsigned int prefilter_find_scalar(const prefilter* pf, const unsigned char* buffer, unsigned int from, unsigned int size) {
+    for (unsigned int i = from; i < size; i++) {
+        unsigned char c = buffer[i];
+        if (c != pf->bytes[0] && c != pf->bytes[1] && c != pf->bytes[2]) continue;
+        if (!pf->has_next || i + 1 == size || buffer[i + 1] == pf->next) return i;
+    }
+    return size;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+unsigned int prefilter_find_sse2(const prefilter* pf, const unsigned char* buffer, unsigned int from, unsigned int size) {
+    __m128i b0 = _mm_set1_epi8(pf->bytes[0]);
+    __m128i b1 = _mm_set1_epi8(pf->bytes[1]);
+    __m128i b2 = _mm_set1_epi8(pf->bytes[2]);
+    __m128i next = _mm_set1_epi8(pf->next);
+    unsigned int i = from;
+    for (; i + 16 + pf->has_next <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buffer + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b0), _mm_cmpeq_epi8(v, b1)), _mm_cmpeq_epi8(v, b2));
+        if (pf->has_next) {
+            __m128i w = _mm_loadu_si128((const __m128i*)(buffer + i + 1));
+            m = _mm_and_si128(m, _mm_cmpeq_epi8(w, next));
+        }
+        unsigned int mask = _mm_movemask_epi8(m);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return prefilter_find_scalar(pf, buffer, i, size);
+}
+
+__attribute__((target("avx2")))
+unsigned int prefilter_find_avx2(const prefilter* pf, const unsigned char* buffer, unsigned int from, unsigned int size) {
+    __m256i b0 = _mm256_set1_epi8(pf->bytes[0]);
+    __m256i b1 = _mm256_set1_epi8(pf->bytes[1]);
+    __m256i b2 = _mm256_set1_epi8(pf->bytes[2]);
+    __m256i next = _mm256_set1_epi8(pf->next);
+    unsigned int i = from;
+    for (; i + 32 + pf->has_next <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buffer + i));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, b0), _mm256_cmpeq_epi8(v, b1)), _mm256_cmpeq_epi8(v, b2));
+        if (pf->has_next) {
+            __m256i w = _mm256_loadu_si256((const __m256i*)(buffer + i + 1));
+            m = _mm256_and_si256(m, _mm256_cmpeq_epi8(w, next));
+        }
+        unsigned int mask = _mm256_movemask_epi8(m);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return prefilter_find_scalar(pf, buffer, i, size);
+}
+#endif
+
+// Returns the first position >= from holding a prefilter byte, or size if there is none.
+// Picked by prefilter_build according to what the CPU supports.
+unsigned int (*prefilter_find)(const prefilter*, const unsigned char*, unsigned int, unsigned int) = prefilter_find_scalar;
+
+// Derives the prefilter from the loaded signatures. A single signature is searched by its
+// rarest byte and the byte after it; otherwise the automaton's root is used when all
+// signatures share one leading byte pair or start with one of at most three bytes.
+void prefilter_build(sig_db* db) {
+    prefilter* pf = &db->filter;
+    const ac_automaton* ac = &db->matcher;
+    memset(pf, 0, sizeof(prefilter));
+    if (ac->num_nodes == 0) return;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) prefilter_find = prefilter_find_avx2;
+    else if (__builtin_cpu_supports("sse2")) prefilter_find = prefilter_find_sse2;
+#endif
+
+    if (db->count == 1) {
+        const unsigned char* sig = db->bytes + db->viruses[0].offset;
+        unsigned int size = db->viruses[0].SigSize, rare = 0;
+        for (unsigned int i = 1; i < size; i++) {
+            if (byte_commonness(sig[i]) < byte_commonness(sig[rare])) rare = i;
+        }
+        pf->num_bytes = 1;
+        pf->bytes[0] = pf->bytes[1] = pf->bytes[2] = sig[rare];
+        pf->shift = rare;
+        if (rare + 1 < size) {
+            pf->has_next = 1;
+            pf->next = sig[rare + 1];
+        }
+        return;
+    }
+
+    int first[3], num_first = 0;
+    for (int c = 0; c < 256; c++) {
+        if (ac->root_next[c] == 0) continue;
+        if (num_first == 3) return;
+        first[num_first++] = c;
+    }
+    if (num_first == 0) return;
+    for (int i = 0; i < 3; i++) {
+        pf->bytes[i] = first[i < num_first ? i : 0];
+    }
+    pf->num_bytes = num_first;
+
+    const ac_node* n = &ac->nodes[ac->root_next[first[0]]];
+    if (num_first == 1 && n->out == -1 && n->num_edges == 1) {
+        pf->has_next = 1;
+        pf->next = ac->edges[n->first_edge].byte;
+    }
+}
+
+// Runs the compiled automaton, so every byte is visited once regardless of the signature count
+void ac_scan(unsigned char* buffer, unsigned int size, long base, unsigned int overlap, sig_db* db, scan_result* result) {
+    const ac_automaton* ac = &db->matcher;
+    const prefilter* pf = &db->filter;
+    int state = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        // In the root state no match is in progress, so skip to the next possible start
+        if (state == 0 && pf->num_bytes > 0) {
+            if (size - i <= pf->shift) break;
+            i = prefilter_find(pf, buffer, i + pf->shift, size) - pf->shift;
+            if (i + pf->shift >= size) break;
+        }
+        state = ac_next(ac, state, buffer[i]);
+        // An anchor inside the overlap can still belong to a pattern ending after it
+        if (i < overlap && db->num_patterns == 0) continue;
+        int s = ac->nodes[state].out >= 0 ? state : ac->nodes[state].dict;
+        for (; s != -1; s = ac->nodes[s].dict) {
+            for (int o = ac->nodes[s].out; o != -1; o = ac->outputs[o].next) {
+                virus* v = &db->viruses[ac->outputs[o].sig];
+                PROFILE_COUNT(db, v, candidates);
+                // pattern_report counts its own comparison
+                if (v->pattern == 0) PROFILE_COUNT(db, v, comparisons);
+                report_found(db, v, buffer, size, i + 1 - v->SigSize, base, overlap, result);
+            }
+        }
+    }
+}
+
+// Reference matcher: memcmp of every signature at every offset
+void naive_scan(unsigned char* buffer, unsigned int size, long base, unsigned int overlap, sig_db* db, scan_result* result) {
+    for (virus* v = db->viruses; v < db->viruses + db->count; v++) {
+        const unsigned char* sig = db->bytes + v->offset;
+        if (v->SigSize == 0) continue;
+        // Matches ending inside the overlap were found in the previous chunk
+        unsigned int i = overlap >= v->SigSize && v->pattern == 0 ? overlap - v->SigSize + 1 : 0;
+        for (; i + v->SigSize <= size; i++) {
+            PROFILE_COUNT(db, v, candidates);
+            PROFILE_COUNT(db, v, comparisons);
+            if (memcmp(buffer + i, sig, v->SigSize) == 0) {
+                report_found(db, v, buffer, size, i, base, overlap, result);
+            }
+        }
+    }
+}
+
+static inline unsigned int hash_slot(unsigned int key, unsigned int mask) {
+    return (key * 2654435761u) & mask;
+}
+
+void hash_free(hash_index* index) {
+    free(index->keys);
+    free(index->heads);
+    free(index->next);
+    free(index->short_sigs);
+    memset(index, 0, sizeof(hash_index));
+}
+
+// Builds the prefix index. Returns 0 on success, -1 on allocation failure.
+int hash_build(hash_index* index, sig_db* db) {
+    memset(index, 0, sizeof(hash_index));
+    unsigned int slots = 16;
+    while (slots < 2u * db->count) slots *= 2;
+    index->mask = slots - 1;
+    index->keys = malloc(slots * sizeof(unsigned int));
+    index->heads = malloc(slots * sizeof(int));
+    index->next = malloc(db->count * sizeof(int));
+    index->short_sigs = malloc(db->count * sizeof(int));
+    if (!index->keys || !index->heads || !index->next || !index->short_sigs) {
+        hash_free(index);
+        return -1;
+    }
+    for (unsigned int i = 0; i < slots; i++) index->heads[i] = -1;
+
+    // Insert in reverse so each chain lists signatures in database order
+    for (int n = db->count - 1; n >= 0; n--) {
+        virus* v = &db->viruses[n];
+        if (v->SigSize == 0) continue;
+        if (v->SigSize < HASH_PREFIX) {
+            index->short_sigs[index->num_short++] = n;
+            continue;
+        }
+        const unsigned char* sig = db->bytes + v->offset;
+        unsigned int key = 0;
+        for (int i = 0; i < HASH_PREFIX; i++) key = key << 8 | sig[i];
+
+        unsigned int slot = hash_slot(key, index->mask);
+        while (index->heads[slot] != -1 && index->keys[slot] != key) {
+            slot = (slot + 1) & index->mask;
+        }
+        index->keys[slot] = key;
+        index->next[n] = index->heads[slot];
+        index->heads[slot] = n;
+    }
+    return 0;
+}
+
+// Rolling-hash matcher: one table probe per window, full comparison only on a prefix hit
+void hash_scan(unsigned char* buffer, unsigned int size, long base, unsigned int overlap, sig_db* db, scan_result* result) {
+    const hash_index* index = &db->index;
+
+    for (int k = 0; k < index->num_short; k++) {
+        virus* v = &db->viruses[index->short_sigs[k]];
+        const unsigned char* sig = db->bytes + v->offset;
+        unsigned int i = overlap >= v->SigSize && v->pattern == 0 ? overlap - v->SigSize + 1 : 0;
+        for (; i + v->SigSize <= size; i++) {
+            PROFILE_COUNT(db, v, candidates);
+            PROFILE_COUNT(db, v, comparisons);
+            if (memcmp(buffer + i, sig, v->SigSize) == 0) report_found(db, v, buffer, size, i, base, overlap, result);
+        }
+    }
+
+    if (size < HASH_PREFIX) return;
+    unsigned int key = 0;
+    for (int i = 0; i < HASH_PREFIX - 1; i++) key = key << 8 | buffer[i];
+    for (unsigned int i = 0; i + HASH_PREFIX <= size; i++) {
+        key = key << 8 | buffer[i + HASH_PREFIX - 1];
+        unsigned int slot = hash_slot(key, index->mask);
+        while (index->heads[slot] != -1 && index->keys[slot] != key) {
+            slot = (slot + 1) & index->mask;
+        }
+        for (int n = index->heads[slot]; n != -1; n = index->next[n]) {
+            virus* v = &db->viruses[n];
+            PROFILE_COUNT(db, v, candidates);
+            if (i + v->SigSize > size || (i + v->SigSize <= overlap && v->pattern == 0)) continue;
+            const unsigned char* sig = db->bytes + v->offset;
+            PROFILE_COUNT(db, v, comparisons);
+            if (memcmp(buffer + i + HASH_PREFIX, sig + HASH_PREFIX, v->SigSize - HASH_PREFIX) == 0) {
+                report_found(db, v, buffer, size, i, base, overlap, result);
+            }
+        }
+    }
+}
+
+// Scans one chunk of a file whose first byte sits at offset base. The first overlap bytes
+// repeat the tail of the previous chunk, so only matches ending after them are reported.
+void scan_chunk(unsigned char* buffer, unsigned int size, long base, unsigned int overlap, sig_db* db, scan_result* result) {
+    if (scan_engine == ENGINE_HASH && db->index.heads != NULL) {
+        hash_scan(buffer, size, base, overlap, db, result);
+    } else if (scan_engine != ENGINE_NAIVE && db->matcher.num_nodes > 0) {
+        ac_scan(buffer, size, base, overlap, db, result);
+    } else {
+        naive_scan(buffer, size, base, overlap, db, result);
+    }
+}
+
+// Builds whatever the selected engine needs beyond the records and the automaton
+void prepare_engines(sig_db* db) {
+    prefilter_build(db);
+    if (scan_engine == ENGINE_HASH && hash_build(&db->index, db) != 0) {
+        printf("Failed to build the hash index, using the automaton\n");
+    }
+}
+
+// Parses an --engine argument. Returns 0 on success, -1 for an unknown engine.
+int set_engine(const char* name) {
+    if (strcmp(name, "aho") == 0) scan_engine = ENGINE_AHO;
+    else if (strcmp(name, "hash") == 0) scan_engine = ENGINE_HASH;
+    else if (strcmp(name, "naive") == 0) scan_engine = ENGINE_NAIVE;
+    else return -1;
+    return 0;
+}
+
+// Function to detect viruses in a buffer by comparing with known signatures.
+// Detections are appended to result.
+void detect_virus(char *buffer, unsigned int size, sig_db* db, scan_result* result) {
+    scan_chunk((unsigned char*)buffer, size, 0, 0, db, result);
+}
+
+void detect_virus_naive(char *buffer, unsigned int size, sig_db* db, scan_result* result) {
+    naive_scan((unsigned char*)buffer, size, 0, 0, db, result);
+}
+
+// Scans bytes [start, end) of a regular file in place through a read-only mapping, without
+// copying them. end == -1 means up to the end of the file. Matches must end inside the range
+// but may start up to max(SigSize)-1 bytes before it, so adjacent ranges tile the file.
+// Returns 1 if the file cannot be mapped and has to be streamed instead.
+int scan_mapped(FILE* file, long start, long end, sig_db* db, scan_result* result) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return 1;
+    }
+    if (end == -1 || end > st.st_size) end = st.st_size;
+    if (start >= end) return 0;
+
+    unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    // The matcher takes 32-bit sizes, so very large ranges are walked in overlapping windows
+    unsigned int keep = db->max_size > 0 ? db->max_size - 1 : 0;
+    unsigned int overlap = start < keep ? start : keep;
+    long base = start - overlap;
+    while (1) {
+        long left = end - base;
+        unsigned int size = left > MAP_WINDOW_SIZE ? MAP_WINDOW_SIZE : left;
+        scan_chunk(map + base, size, base, overlap, db, result);
+        if (base + size >= end) break;
+        base += size - keep;
+        overlap = keep;
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
+
+// Streams the file through the matcher in fixed-size chunks. Each chunk is prefixed
+// with the last max(SigSize)-1 bytes of the previous one, so signatures crossing a chunk
+// boundary are still found, and memory use does not depend on the file size.
+int scan_stream(FILE* file, sig_db* db, scan_result* result) {
+    unsigned int keep = db->max_size > 0 ? db->max_size - 1 : 0;
+    unsigned char* buffer = malloc(SCAN_CHUNK_SIZE + keep);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    long base = 0;          // file offset of buffer[0]
+    unsigned int have = 0;  // bytes carried over from the previous chunk
+    size_t bytesRead;
+    while ((bytesRead = fread(buffer + have, 1, SCAN_CHUNK_SIZE, file)) > 0) {
+        unsigned int size = have + bytesRead;
+        scan_chunk(buffer, size, base, have, db, result);
+
+        unsigned int carry = size < keep ? size : keep;
+        memmove(buffer, buffer + size - carry, carry);
+        base += size - carry;
+        have = carry;
+    }
+
+    int failed = ferror(file);
+    if (failed) fprintf(stderr, "Error reading suspected file\n");
+    free(buffer);
+    return failed ? -1 : 0;
+}
+
+// Scans the whole file: regular files are mapped, pipes and special files are streamed.
+// Detections are appended to result ordered by offset. Returns -1 if the file cannot be read.
+int scan_file(char* fileName, sig_db* db, scan_result* result) {
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    int first = result->count;
+    int status = scan_mapped(file, 0, -1, db, result);
+    if (status == 1) {
+        status = scan_stream(file, db, result);
+    }
+    fclose(file);
+
+    qsort(result->locations + first, result->count - first, sizeof(virus_location), compare_locations);
+    return status;
+}
+
+// Function to neutralize a detected virus by replacing its first byte with RET instruction
+void neutralize_virus(char *fileName, long signatureOffset) {
+    virus_location loc = {signatureOffset, 0, ""};
+    scan_result single = {&loc, 1, 1, 0, 1, 0};
+    neutralize_viruses(fileName, &single, NULL);
+}
+
+int compare_offsets(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Appends the original bytes at offsets to the journal and syncs it to disk
+int write_journal(FILE* journal, char* fileName, int fd, long* offsets, int count, unsigned char* map, long map_start) {
+    struct stat st;
+    char* path = realpath(fileName, NULL);
+    if (path == NULL || fstat(fd, &st) != 0) {
+        free(path);
+        return -1;
+    }
+    journal_header hdr = {"VIRU", JOURNAL_VERSION, strlen(path), count, st.st_size, st.st_dev, st.st_ino};
+    int written = fwrite(&hdr, sizeof(hdr), 1, journal) == 1 && fwrite(path, 1, hdr.path_len, journal) == hdr.path_len;
+    free(path);
+    if (!written) return -1;
+    for (int i = 0; i < count; i++) {
+        journal_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.offset = offsets[i];
+        if (map != NULL) {
+            entry.original = map[offsets[i] - map_start];
+        } else if (pread(fd, &entry.original, 1, offsets[i]) != 1) {
+            return -1;
+        }
+        if (fwrite(&entry, sizeof(entry), 1, journal) != 1) return -1;
+    }
+    if (fflush(journal) != 0 || fsync(fileno(journal)) != 0) return -1;
+    return 0;
+}
+
+// Neutralizes every detection in result with one open of the file: offsets are sorted
+// and deduplicated, recorded in the journal if one is given, then patched with pwrite,
+// or through a shared mapping and a single msync when there are many of them.
+// Returns the number of patched offsets, or -1 on failure.
+int neutralize_viruses(char* fileName, scan_result* result, FILE* journal) {
+    if (result->count == 0) return 0;
+
+    long* offsets = malloc(result->count * sizeof(long));
+    if (offsets == NULL) return -1;
+    for (int i = 0; i < result->count; i++) {
+        offsets[i] = result->locations[i].offset;
+    }
+    qsort(offsets, result->count, sizeof(long), compare_offsets);
+    int count = 0;
+    for (int i = 0; i < result->count; i++) {
+        if (count == 0 || offsets[count - 1] != offsets[i]) offsets[count++] = offsets[i];
+    }
+
+    int fd = open(fileName, O_RDWR);
+    if (fd < 0) {
+        printf("Failed to open suspected file\n");
+        free(offsets);
+        return -1;
+    }
+
+    // Map only the pages spanning the patched offsets
+    unsigned char* map = NULL;
+    long map_start = 0;
+    size_t map_size = 0;
+    if (count >= PATCH_MMAP_MIN) {
+        long page = sysconf(_SC_PAGESIZE);
+        map_start = offsets[0] / page * page;
+        map_size = offsets[count - 1] + 1 - map_start;
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_start);
+        if (map == MAP_FAILED) map = NULL;
+    }
+
+    int patched = -1;
+    if (journal != NULL && write_journal(journal, fileName, fd, offsets, count, map, map_start) != 0) {
+        printf("Failed to write undo journal, %s left unchanged\n", fileName);
+    } else if (map != NULL) {
+        // Replace first byte with RET instruction (0xC3)
+        for (int i = 0; i < count; i++) {
+            map[offsets[i] - map_start] = 0xC3;
+        }
+        if (msync(map, map_size, MS_SYNC) == 0) patched = count;
+        else printf("Error writing RET instructions\n");
+    } else {
+        unsigned char ret = 0xC3;
+        patched = 0;
+        for (int i = 0; i < count; i++) {
+            if (pwrite(fd, &ret, 1, offsets[i]) == 1) patched++;
+            else printf("Error writing RET instruction at offset %ld\n", offsets[i]);
+        }
+    }
+
+    if (map != NULL) munmap(map, map_size);
+    close(fd);
+    free(offsets);
+    if (patched >= 0) {
+        printf("Neutralized %d virus locations in %s\n", patched, fileName);
+    }
+    return patched;
+}
+
+// Restores every byte recorded in a journal, newest block first, so a file fixed
+// twice ends up with its original contents. Returns 0 on success, -1 otherwise.
+int undo_journal(char* journalName) {
+    FILE* journal = fopen(journalName, "rb");
+    if (journal == NULL) {
+        printf("Failed to open journal %s\n", journalName);
+        return -1;
+    }
+
+    // Index the blocks first; they are replayed in reverse
+    long* blocks = NULL;
+    int num_blocks = 0, capacity = 0, failed = 0;
+    journal_header hdr;
+    while (fread(&hdr, sizeof(hdr), 1, journal) == 1) {
+        if (memcmp(hdr.magic, "VIRU", 4) != 0 || hdr.version != JOURNAL_VERSION) {
+            failed = 1;
+            break;
+        }
+        if (num_blocks == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            long* grown = realloc(blocks, capacity * sizeof(long));
+            if (grown == NULL) {
+                failed = 1;
+                break;
+            }
+            blocks = grown;
+        }
+        blocks[num_blocks++] = ftell(journal) - sizeof(hdr);
+        if (fseek(journal, hdr.path_len + (long)hdr.count * sizeof(journal_entry), SEEK_CUR) != 0) {
+            failed = 1;
+            break;
+        }
+    }
+    if (failed) printf("Journal %s is corrupt\n", journalName);
+
+    for (int b = num_blocks - 1; !failed && b >= 0; b--) {
+        char path[4096];
+        fseek(journal, blocks[b], SEEK_SET);
+        if (fread(&hdr, sizeof(hdr), 1, journal) != 1 || hdr.path_len >= sizeof(path) ||
+            fread(path, 1, hdr.path_len, journal) != hdr.path_len) {
+            failed = 1;
+            break;
+        }
+        path[hdr.path_len] = '\0';
+
+        int fd = open(path, O_WRONLY);
+        if (fd < 0) {
+            printf("Failed to open %s\n", path);
+            failed = 1;
+            break;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size != hdr.size || st.st_dev != hdr.dev || st.st_ino != hdr.ino) {
+            printf("%s is not the file that was fixed, not restored\n", path);
+            close(fd);
+            failed = 1;
+            break;
+        }
+        for (unsigned int i = 0; i < hdr.count; i++) {
+            journal_entry entry;
+            if (fread(&entry, sizeof(entry), 1, journal) != 1 ||
+                pwrite(fd, &entry.original, 1, entry.offset) != 1) {
+                failed = 1;
+                break;
+            }
+        }
+        close(fd);
+        if (!failed) printf("Restored %u bytes in %s\n", hdr.count, path);
+    }
+
+    free(blocks);
+    fclose(journal);
+    return failed ? -1 : 0;
+}
+
+
+void list_print(sig_db* db, FILE* output) {
+    for (virus* v = db->viruses; v < db->viruses + db->count; v++) {
+        printVirus(db, v, output);
+    }
+}
+
+// Appends a record whose bytes were just read into the spare tail of the arena. For a
+// masked signature sig is its anchor, the last part of the compiled pattern.
+// Returns 1 on success, 0 if the record array cannot grow.
+int list_append(sig_db* db, virus* data, unsigned char* sig) {
+    if (db->count == db->capacity) {
+        int capacity = db->capacity ? db->capacity * 2 : 256;
+        virus* grown = realloc(db->viruses, capacity * sizeof(virus));
+        if (grown == NULL) return 0;
+        db->viruses = grown;
+        db->capacity = capacity;
+    }
+    
+    virus* v = &db->viruses[db->count++];
+    *v = *data;
+    v->offset = sig - db->bytes;
+    db->num_bytes = v->offset + v->SigSize;
+    unsigned short size = v->SigSize;
+    if (v->pattern != 0) {
+        pattern_header h;
+        memcpy(&h, sig - v->pattern, sizeof(h));
+        size = h.max_size;
+        db->num_patterns++;
+    }
+    if (size > db->max_size) db->max_size = size;
+    return 1;
+}
+
+void list_free(sig_db* db) {
+    hash_free(&db->index);
+    if (db->map != NULL) {
+        munmap(db->map, db->map_size);
+    } else {
+        ac_free(&db->matcher);
+        free(db->viruses);
+        free(db->bytes);
+    }
+    free(db);
+}
+
+sig_db* load_signatures(char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        printf("Failed to open signatures file\n");
+        return NULL;
+    }
+    
+    int format = checkMagicNumber(file);
+    if (!format) {
+        printf("Invalid magic number\n");
+        fclose(file);
+        return NULL;
+    }
+    if (format == 2) {
+        fclose(file);
+        return load_compiled(filename);
+    }
+    
+    sig_db* db = calloc(1, sizeof(sig_db));
+    if (db == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    while (readVirus(file, db)) {
+    }
+    
+    fclose(file);
+
+    if (db->count == 0) {
+        printf("No signatures loaded\n");
+        list_free(db);
+        return NULL;
+    }
+    if (ac_build(&db->matcher, db) != 0) {
+        printf("Failed to compile signatures, using the slow matcher\n");
+    }
+    prepare_engines(db);
+    return db;
+}
+
+int host_is_little_endian() {
+    unsigned short probe = 1;
+    return *(unsigned char*)&probe == 1;
+}
+
+// Writes one section padded to 8 bytes and advances *offset past it
+int write_section(FILE* file, const void* data, size_t size, unsigned long long* offset) {
+    static const char zeros[8] = {0};
+    size_t padding = (8 - size % 8) % 8;
+    if (size > 0 && fwrite(data, 1, size, file) != size) return -1;
+    if (padding > 0 && fwrite(zeros, 1, padding, file) != padding) return -1;
+    *offset += size + padding;
+    return 0;
+}
+
+// Writes the records and the compiled automaton as a VIRC database that load_compiled
+// maps without parsing. Returns 0 on success, -1 on failure.
+int compile_signatures(sig_db* db, char* filename) {
+    const ac_automaton* ac = &db->matcher;
+    if (ac->num_nodes == 0 || !host_is_little_endian()) {
+        printf("Signatures cannot be compiled on this host\n");
+        return -1;
+    }
+
+    // Records carry padding; copy them zeroed so the output is reproducible
+    virus* records = calloc(db->count, sizeof(virus));
+    if (records == NULL) return -1;
+    for (int i = 0; i < db->count; i++) {
+        records[i].offset = db->viruses[i].offset;
+        records[i].SigSize = db->viruses[i].SigSize;
+        memcpy(records[i].virusName, db->viruses[i].virusName, 16);
+        records[i].pattern = db->viruses[i].pattern;
+    }
+    ac_edge* edges = calloc(ac->num_nodes, sizeof(ac_edge));
+    if (edges == NULL) {
+        free(records);
+        return -1;
+    }
+    for (int i = 0; i < ac->num_nodes - 1; i++) {
+        edges[i].byte = ac->edges[i].byte;
+        edges[i].target = ac->edges[i].target;
+    }
+
+    compiled_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "VIRC", 4);
+    hdr.version = COMPILED_VERSION;
+    hdr.count = db->count;
+    hdr.max_size = db->max_size;
+    hdr.num_nodes = ac->num_nodes;
+    hdr.num_outputs = ac->num_outputs;
+    hdr.num_dense = ac->num_dense;
+    hdr.num_patterns = db->num_patterns;
+    hdr.num_bytes = db->num_bytes;
+    memcpy(hdr.root_next, ac->root_next, sizeof(hdr.root_next));
+
+    size_t sizes[] = {
+        db->count * sizeof(virus),
+        db->num_bytes,
+        ac->num_nodes * sizeof(ac_node),
+        (ac->num_nodes - 1) * sizeof(ac_edge),
+        ac->num_outputs * sizeof(ac_output),
+        (size_t)ac->num_dense * 256 * sizeof(int),
+    };
+    const void* sections[] = {records, db->bytes, ac->nodes, edges, ac->outputs, ac->dense_next};
+    unsigned long long* offsets[] = {
+        &hdr.viruses_offset, &hdr.bytes_offset, &hdr.nodes_offset,
+        &hdr.edges_offset, &hdr.outputs_offset, &hdr.dense_offset,
+    };
+    unsigned long long offset = sizeof(compiled_header);
+    for (int i = 0; i < 6; i++) {
+        *offsets[i] = offset;
+        offset += sizes[i] + (8 - sizes[i] % 8) % 8;
+    }
+
+    int failed = 0;
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        failed = 1;
+    } else {
+        offset = 0;
+        failed = write_section(file, &hdr, sizeof(hdr), &offset) != 0;
+        for (int i = 0; !failed && i < 6; i++) {
+            failed = write_section(file, sections[i], sizes[i], &offset) != 0;
+        }
+        if (fclose(file) != 0) failed = 1;
+    }
+    if (failed) printf("Failed to write compiled signatures\n");
+
+    free(records);
+    free(edges);
+    return failed ? -1 : 0;
+}
+
+// Checks that every record of a mapped database lies inside its byte arena and that the
+// compiled pattern of a masked signature is complete in front of its anchor
+int records_valid(sig_db* db) {
+    int num_patterns = 0;
+    for (virus* v = db->viruses; v < db->viruses + db->count; v++) {
+        if (v->pattern > v->offset || v->offset > db->num_bytes || v->SigSize > db->num_bytes - v->offset) return 0;
+        if (v->pattern == 0) {
+            if (v->SigSize > db->max_size) return 0;
+            continue;
+        }
+        const unsigned char* prog = pattern_of(db, v);
+        pattern_header h;
+        if (v->pattern < sizeof(h)) return 0;
+        memcpy(&h, prog, sizeof(h));
+        if (h.num_segments == 0 || h.anchor_segment >= h.num_segments || h.max_size > db->max_size ||
+            v->pattern < sizeof(h) + (size_t)h.num_segments * sizeof(pattern_segment)) return 0;
+        for (int j = 0; j < h.num_segments; j++) {
+            pattern_segment seg;
+            pattern_segment_at(prog, j, &seg);
+            if (seg.data + 2 * seg.size > v->pattern) return 0;
+            if (j == h.anchor_segment && h.anchor_start + v->SigSize > seg.size) return 0;
+        }
+        num_patterns++;
+    }
+    return num_patterns == db->num_patterns;
+}
+
+// Whether count elements of elem_size bytes at offset fit in a file of size bytes
+// and start at the 8-byte alignment compile_signatures gives every section
+int section_fits(unsigned long long size, unsigned long long offset, unsigned long long count, size_t elem_size) {
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / elem_size;
+}
+
+// Maps a VIRC database. The header, the section bounds and every stored index are checked
+// once; the tables themselves are used in place. If only the automaton is damaged it is
+// compiled again from the signature records.
+sig_db* load_compiled(char* filename) {
+    if (!host_is_little_endian()) {
+        printf("Compiled signatures are not supported on this host\n");
+        return NULL;
+    }
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        printf("Failed to open signatures file\n");
+        return NULL;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fileno(file), &st) == 0 && st.st_size >= sizeof(compiled_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    }
+    fclose(file);
+    if (map == MAP_FAILED) {
+        printf("Failed to map signatures file\n");
+        return NULL;
+    }
+
+    const compiled_header* hdr = map;
+    unsigned long long size = st.st_size;
+    int valid = hdr->version == COMPILED_VERSION && hdr->num_nodes > 0 && hdr->count > 0 &&
+        hdr->count <= INT_MAX && hdr->num_nodes <= INT_MAX && hdr->num_outputs <= INT_MAX &&
+        hdr->num_dense <= INT_MAX / 256 && hdr->max_size <= 0xFFFF && hdr->num_bytes <= UINT_MAX &&
+        section_fits(size, hdr->viruses_offset, hdr->count, sizeof(virus)) &&
+        section_fits(size, hdr->bytes_offset, hdr->num_bytes, 1) &&
+        section_fits(size, hdr->nodes_offset, hdr->num_nodes, sizeof(ac_node)) &&
+        section_fits(size, hdr->edges_offset, hdr->num_nodes - 1, sizeof(ac_edge)) &&
+        section_fits(size, hdr->outputs_offset, hdr->num_outputs, sizeof(ac_output)) &&
+        section_fits(size, hdr->dense_offset, (unsigned long long)hdr->num_dense * 256, sizeof(int));
+    sig_db* db = valid ? calloc(1, sizeof(sig_db)) : NULL;
+    if (db != NULL) {
+        char* base = map;
+        db->map = map;
+        db->map_size = st.st_size;
+        db->viruses = (virus*)(base + hdr->viruses_offset);
+        db->count = db->capacity = hdr->count;
+        db->bytes = (unsigned char*)(base + hdr->bytes_offset);
+        db->num_bytes = db->bytes_capacity = hdr->num_bytes;
+        db->max_size = hdr->max_size;
+        db->num_patterns = hdr->num_patterns;
+        db->matcher.nodes = (ac_node*)(base + hdr->nodes_offset);
+        db->matcher.num_nodes = hdr->num_nodes;
+        db->matcher.edges = (ac_edge*)(base + hdr->edges_offset);
+        db->matcher.outputs = (ac_output*)(base + hdr->outputs_offset);
+        db->matcher.num_outputs = hdr->num_outputs;
+        db->matcher.dense_next = hdr->num_dense > 0 ? (int*)(base + hdr->dense_offset) : NULL;
+        db->matcher.num_dense = hdr->num_dense;
+        memcpy(db->matcher.root_next, hdr->root_next, sizeof(hdr->root_next));
+        valid = records_valid(db);
+    }
+    if (!valid || db == NULL) {
+        if (!valid) printf("Compiled signatures are corrupt or from another version, recompile them\n");
+        free(db);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    if (!ac_validate(&db->matcher, db)) {
+        // The records are sound: copy them off the mapping and compile them again
+        printf("Compiled automaton is corrupt, rebuilding it from the signatures\n");
+        virus* viruses = malloc(db->count * sizeof(virus));
+        unsigned char* bytes = malloc(db->num_bytes + 1);
+        if (viruses == NULL || bytes == NULL) {
+            free(viruses);
+            free(bytes);
+            free(db);
+            munmap(map, st.st_size);
+            return NULL;
+        }
+        memcpy(viruses, db->viruses, db->count * sizeof(virus));
+        memcpy(bytes, db->bytes, db->num_bytes);
+        db->viruses = viruses;
+        db->bytes = bytes;
+        db->map = NULL;
+        munmap(map, st.st_size);
+        if (ac_build(&db->matcher, db) != 0) {
+            printf("Failed to compile signatures, using the slow matcher\n");
+        }
+    }
+    prepare_engines(db);
+    return db;
+}
+
+// FNV-1a over everything that affects a verdict, so any change to the signatures
+// invalidates a cache made with the old ones
+unsigned long long db_fingerprint(sig_db* db) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (virus* v = db->viruses; v < db->viruses + db->count; v++) {
+        unsigned char size[2] = {v->SigSize & 0xFF, v->SigSize >> 8};
+        const unsigned char* parts[] = {size, (unsigned char*)v->virusName, db->bytes + v->offset - v->pattern};
+        size_t lens[] = {2, sizeof(v->virusName), v->pattern + v->SigSize};
+        for (int p = 0; p < 3; p++) {
+            for (size_t i = 0; i < lens[p]; i++) {
+                h = (h ^ parts[p][i]) * 1099511628211ULL;
+            }
+        }
+    }
+    return h;
+}
+
+// Content digest of a whole file, FNV-1a style over 8-byte words. Never 0, which marks
+// "not computed" in the cache. Returns 0 if the file cannot be read.
+unsigned long long file_digest(const char* path, long size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    unsigned long long h = 14695981039346656037ULL ^ (unsigned long long)size;
+    if (size > 0) {
+        unsigned char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        long i = 0;
+        for (; i + 8 <= size; i += 8) {
+            unsigned long long word;
+            memcpy(&word, map + i, 8);
+            h = (h ^ word) * 1099511628211ULL;
+        }
+        for (; i < size; i++) {
+            h = (h ^ map[i]) * 1099511628211ULL;
+        }
+        munmap(map, size);
+    }
+    close(fd);
+    return h ? h : 1;
+}
 
-typedef struct virus {
-    unsigned short SigSize;
-    char virusName[16];
-    unsigned char* sig;
-} virus;
+// Maps a cache file with room for num_slots entries, clearing it when reset is set
+int cache_map(verdict_cache* cache, unsigned int num_slots, int reset) {
+    size_t size = sizeof(cache_header) + (size_t)num_slots * sizeof(cache_entry);
+    if (reset && ftruncate(cache->fd, 0) != 0) return -1;
+    if (ftruncate(cache->fd, size) != 0) return -1;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED) return -1;
+    cache->hdr = map;
+    cache->slots = (cache_entry*)((char*)map + sizeof(cache_header));
+    cache->map_size = size;
+    return 0;
+}
 
-typedef struct link link;
-struct link {
-    link *nextVirus;
-    virus *vir;
-};
+// Opens or creates the cache at path. A cache made with other signatures or by another
+// version is emptied. The file stays locked until cache_close, so concurrent scans
+// sharing one cache take turns. Returns NULL if the cache cannot be used.
+verdict_cache* cache_open(char* path, unsigned long long db_version) {
+    verdict_cache* cache = calloc(1, sizeof(verdict_cache));
+    if (cache == NULL) return NULL;
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->fd < 0 || flock(cache->fd, LOCK_EX) != 0) {
+        if (cache->fd >= 0) close(cache->fd);
+        free(cache);
+        return NULL;
+    }
+    cache->opened = time(NULL);
 
-typedef struct virus_location {
-    int offset;
-    char name[16];
-} virus_location;
+    struct stat st;
+    cache_header hdr;
+    int valid = fstat(cache->fd, &st) == 0
+        && pread(cache->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+        && memcmp(hdr.magic, "VIRK", 4) == 0
+        && hdr.version == CACHE_VERSION
+        && hdr.db_version == db_version
+        && hdr.num_slots > 0 && (hdr.num_slots & (hdr.num_slots - 1)) == 0
+        && st.st_size == sizeof(cache_header) + (off_t)hdr.num_slots * sizeof(cache_entry);
 
-int is_little_endian = 1;  // Default to little endian
+    if (cache_map(cache, valid ? hdr.num_slots : CACHE_MIN_SLOTS, !valid) != 0) {
+        close(cache->fd);
+        free(cache);
+        return NULL;
+    }
+    if (!valid) {
+        *cache->hdr = (cache_header){{'V', 'I', 'R', 'K'}, CACHE_VERSION, db_version, CACHE_MIN_SLOTS, 0, 0, 0};
+    }
+    return cache;
+}
 
-// Function declarations
-virus* readVirus(FILE* file);
-void printVirus(virus* virus, FILE* output);
-int checkMagicNumber(FILE* file);
-void list_print(link *virus_list, FILE* output);
-link* list_append(link* virus_list, virus* data);
-void list_free(link *virus_list);
-link* load_signatures(char* filename);
-void print_menu();
-void detect_virus(char *buffer, unsigned int size, link *virus_list, virus_location* locations, int* count);
-void neutralize_virus(char *fileName, int signatureOffset);
+void cache_close(verdict_cache* cache) {
+    cache->hdr->hits += cache->hits;
+    cache->hdr->misses += cache->misses;
+    munmap(cache->hdr, cache->map_size);
+    close(cache->fd);
+    free(cache);
+}
 
+// Slot holding the entry for (dev, ino), or the empty slot where it would go
+cache_entry* cache_slot(cache_entry* slots, unsigned int num_slots, unsigned long long dev, unsigned long long ino) {
+    unsigned int mask = num_slots - 1;
+    unsigned int i = (unsigned int)((ino * 0x9E3779B97F4A7C15ULL ^ dev) >> 32) & mask;
+    while (slots[i].ino != 0 && (slots[i].ino != ino || slots[i].dev != dev)) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
 
-unsigned short convert_endian(unsigned short num) {
-    if (is_little_endian) {
-        return num;
+// Returns 1 if target has a clean verdict that still applies. With digest set the file is
+// read to confirm its contents; the identity alone never touches the file.
+int cache_lookup(verdict_cache* cache, scan_target* t, int digest) {
+    cache_entry* e = cache_slot(cache->slots, cache->hdr->num_slots, t->dev, t->ino);
+    int valid = e->ino != 0 && e->size == t->size
+        && e->mtime_sec == t->mtime_sec && e->mtime_nsec == t->mtime_nsec;
+    if (valid && digest) {
+        valid = e->digest != 0 && e->digest == file_digest(t->path, t->size);
     }
-    return (num >> 8) | (num << 8);  // Swap bytes for big endian
+    if (valid) cache->hits++;
+    else cache->misses++;
+    return valid;
 }
 
-virus* readVirus(FILE* file) {
-    virus* v = malloc(sizeof(virus));
-    if (v == NULL) return NULL;
-    
-    unsigned short size;
-    if (fread(&size, sizeof(unsigned short), 1, file) != 1) {
-        free(v);
-        return NULL;
+// Doubles the table, rehashing every entry into the larger mapping. The old mapping is
+// kept until the new one exists, so a failure leaves the cache as it was.
+int cache_grow(verdict_cache* cache) {
+    cache_header* old_hdr = cache->hdr;
+    cache_entry* old = cache->slots;
+    size_t old_size = cache->map_size;
+    unsigned int num_slots = old_hdr->num_slots;
+    size_t size = (size_t)num_slots * sizeof(cache_entry);
+    cache_entry* copy = malloc(size);
+    if (copy == NULL) return -1;
+    memcpy(copy, old, size);
+
+    if (cache_map(cache, num_slots * 2, 0) != 0) {
+        cache->hdr = old_hdr;
+        cache->slots = old;
+        cache->map_size = old_size;
+        // The file may have grown already; cache_open empties a cache of the wrong size
+        free(copy);
+        return -1;
     }
-    v->SigSize = convert_endian(size);
-    
-    if (fread(v->virusName, sizeof(char), 16, file) != 16) {
-        free(v);
-        return NULL;
+    *cache->hdr = *old_hdr;
+    cache->hdr->num_slots = num_slots * 2;
+    munmap(old_hdr, old_size);
+    memset(cache->slots, 0, size * 2);
+    for (unsigned int i = 0; i < num_slots; i++) {
+        if (copy[i].ino != 0) {
+            *cache_slot(cache->slots, num_slots * 2, copy[i].dev, copy[i].ino) = copy[i];
+        }
     }
-    
-    v->sig = malloc(v->SigSize);
-    if (v->sig == NULL) {
-        free(v);
-        return NULL;
+    free(copy);
+    return 0;
+}
+
+// Records that target scanned clean. Files modified within a second of the scan starting
+// are skipped: a later write in the same timestamp tick would not change their identity.
+void cache_store(verdict_cache* cache, scan_target* t, int digest) {
+    if (t->ino == 0 || t->mtime_sec >= cache->opened - 1) return;
+    if ((cache->hdr->count + 1) * 4 > cache->hdr->num_slots * 3 && cache_grow(cache) != 0) return;
+
+    cache_entry* e = cache_slot(cache->slots, cache->hdr->num_slots, t->dev, t->ino);
+    if (e->ino == 0) cache->hdr->count++;
+    *e = (cache_entry){t->dev, t->ino, t->size, t->mtime_sec, t->mtime_nsec,
+        digest ? file_digest(t->path, t->size) : 0};
+}
+
+// Appends path with the identity from st, or as a failed target when st is NULL
+int add_scan_target(scan_target** targets, int* count, int* capacity, char* path, struct stat* st) {
+    if (*count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 64;
+        scan_target* t = realloc(*targets, grown * sizeof(scan_target));
+        if (t == NULL) return -1;
+        *targets = t;
+        *capacity = grown;
     }
-    
-    if (fread(v->sig, sizeof(unsigned char), v->SigSize, file) != v->SigSize) {
-        free(v->sig);
-        free(v);
-        return NULL;
+    scan_target* t = &(*targets)[*count];
+    *t = (scan_target){strdup(path), 0, st == NULL};
+    if (st != NULL) {
+        t->size = st->st_size;
+        t->dev = st->st_dev;
+        t->ino = st->st_ino;
+        t->mtime_sec = st->st_mtim.tv_sec;
+        t->mtime_nsec = st->st_mtim.tv_nsec;
     }
-    
-    return v;
+    (*count)++;
+    return 0;
 }
 
-void printVirus(virus* virus, FILE* output) {
-    if (!virus || !output) return;
-    
-    fprintf(output, "Virus name: %s\n", virus->virusName);
-    fprintf(output, "Virus size: %d\n", virus->SigSize);
-    fprintf(output, "signature: ");
-    
-    for (int i = 0; i < virus->SigSize; i++) {
-        fprintf(output, "%02X ", virus->sig[i]);
+// Recursively collects every regular file under dirName. Symbolic links are not followed.
+void collect_targets(char* dirName, scan_target** targets, int* count, int* capacity) {
+    DIR* dir = opendir(dirName);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open directory %s\n", dirName);
+        return;
     }
-    fprintf(output, "\n\n");
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        size_t len = strlen(dirName) + strlen(entry->d_name) + 2;
+        char* path = malloc(len);
+        if (path == NULL) break;
+        snprintf(path, len, "%s/%s", dirName, entry->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                collect_targets(path, targets, count, capacity);
+            } else if (S_ISREG(st.st_mode)) {
+                add_scan_target(targets, count, capacity, path, &st);
+            }
+        }
+        free(path);
+    }
+    closedir(dir);
 }
 
-int checkMagicNumber(FILE* file) {
-    char magic[4];
-    if (fread(magic, 1, 4, file) != 4) return 0;
-    
-    if (memcmp(magic, "VIRL", 4) == 0) {
-        is_little_endian = 1;
-        return 1;
+int compare_targets(const void* a, const void* b) {
+    return strcmp(((const scan_target*)a)->path, ((const scan_target*)b)->path);
+}
+
+// Claims the next batch of pieces: one range of a large file, or consecutive
+// small files up to BATCH_SIZE bytes. Returns the number of pieces claimed.
+int claim_pieces(scan_job* job, int* first) {
+    pthread_mutex_lock(&job->lock);
+    *first = job->next_piece;
+    long bytes = 0;
+    while (job->next_piece < job->num_pieces && bytes < BATCH_SIZE) {
+        scan_piece* p = &job->pieces[job->next_piece];
+        long size = (p->end == -1 ? job->targets[p->target].size : p->end) - p->start;
+        if (bytes > 0 && size > BATCH_SIZE) break;
+        bytes += size;
+        job->next_piece++;
     }
-    if (memcmp(magic, "VIRB", 4) == 0) {
-        is_little_endian = 0;
-        return 1;
+    int claimed = job->next_piece - *first;
+    pthread_mutex_unlock(&job->lock);
+    return claimed;
+}
+
+// Keeps an exactly sized copy of the detections in scratch as the result of piece i
+void store_piece_result(scan_job* job, int i, scan_result* scratch) {
+    scan_result* r = &job->results[i];
+    *r = *scratch;
+    r->locations = NULL;
+    r->capacity = 0;
+    if (scratch->count > 0) {
+        r->locations = malloc(scratch->count * sizeof(virus_location));
+        if (r->locations == NULL) {
+            r->dropped += scratch->count;
+            r->count = 0;
+        } else {
+            memcpy(r->locations, scratch->locations, scratch->count * sizeof(virus_location));
+            r->capacity = scratch->count;
+        }
     }
-    return 0;
 }
 
-// Function to detect viruses in a buffer by comparing with known signatures
-void detect_virus(char *buffer, unsigned int size, link *virus_list, virus_location* locations, int* count) {
-    link *current = virus_list;
-    unsigned char* ubuffer = (unsigned char*)buffer;
-    *count = 0;
-    
-    while (current != NULL) {
-        virus *v = current->vir;
-        // Compare buffer content with virus signature
-        for (unsigned int i = 0; i <= size - v->SigSize; i++) {
-            if (memcmp(ubuffer + i, v->sig, v->SigSize) == 0) {
-                printf("Virus detected!\n");
-                printf("Starting byte location: %d\n", i);
-                printf("Virus name: %s\n", v->virusName);
-                printf("Virus size: %d\n\n", v->SigSize);
-                
-                // Store virus location for later neutralization
-                locations[*count].offset = i;
-                strncpy(locations[*count].name, v->virusName, 16);
-                (*count)++;
+void* scan_worker(void* arg) {
+    scan_job* job = arg;
+    // Detections go to one scratch list per worker; most files have none, and those
+    // that do get an exactly sized copy, so nothing is allocated per clean file
+    scan_result scratch = {0};
+    int first, claimed;
+    while ((claimed = claim_pieces(job, &first)) > 0) {
+        for (int i = first; i < first + claimed; i++) {
+            scan_piece* p = &job->pieces[i];
+            scan_target* t = &job->targets[p->target];
+            FILE* file = fopen(t->path, "rb");
+            if (file == NULL) {
+                t->failed = 1;
+                continue;
+            }
+            reset_result(&scratch, job->max_hits);
+#ifdef AV_PROFILE
+            double started = profile_now();
+#endif
+            // Targets were regular files when listed; stream them if they no longer map
+            int status = scan_mapped(file, p->start, p->end, job->db, &scratch);
+            if (status == 1 && p->start == 0) {
+                status = scan_stream(file, job->db, &scratch);
             }
+#ifdef AV_PROFILE
+            p->seconds = profile_now() - started;
+#endif
+            if (status != 0) t->failed = 1;
+            fclose(file);
+            store_piece_result(job, i, &scratch);
         }
-        current = current->nextVirus;
     }
+    free(scratch.locations);
+    return NULL;
 }
 
-// Function to neutralize a detected virus by replacing its first byte with RET instruction
-void neutralize_virus(char *fileName, int signatureOffset) {
-    FILE* file = fopen(fileName, "r+b");
-    if(file == NULL) {
-        printf("Failed to open suspected file\n");
-        return;
+// Read pipeline: the matching side. Buffers are taken in completion order and released
+// as soon as they are matched, which lets the reader refill them.
+int io_pop(io_pipeline* pl) {
+    pthread_mutex_lock(&pl->lock);
+    while (pl->queue_count == 0 && pl->readers_left > 0) {
+        pthread_cond_wait(&pl->changed, &pl->lock);
+    }
+    int b = -1;
+    if (pl->queue_count > 0) {
+        b = pl->queue[pl->queue_head];
+        pl->queue_head = (pl->queue_head + 1) % pl->num_buffers;
+        pl->queue_count--;
     }
+    pthread_mutex_unlock(&pl->lock);
+    return b;
+}
 
-    if(fseek(file, signatureOffset, SEEK_SET) != 0) {
-        printf("Error seeking to position %d\n", signatureOffset);
-        fclose(file);
-        return;
+void io_push(io_pipeline* pl, int b) {
+    pthread_mutex_lock(&pl->lock);
+    pl->queue[(pl->queue_head + pl->queue_count++) % pl->num_buffers] = b;
+    pthread_cond_broadcast(&pl->changed);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+// Takes a free buffer, waiting for one if wait is set. Returns -1 if none is free.
+int io_take(io_pipeline* pl, int wait) {
+    pthread_mutex_lock(&pl->lock);
+    while (wait && pl->num_free == 0) {
+        pthread_cond_wait(&pl->changed, &pl->lock);
     }
+    int b = pl->num_free > 0 ? pl->free[--pl->num_free] : -1;
+    pthread_mutex_unlock(&pl->lock);
+    return b;
+}
 
-    // Replace first byte with RET instruction (0xC3)
-    unsigned char ret = 0xC3;
-    if(fwrite(&ret, 1, 1, file) != 1) {
-        printf("Error writing RET instruction\n");
-    } else {
-        printf("Virus neutralized at offset %d\n", signatureOffset);
+void io_release(io_pipeline* pl, int b) {
+    pthread_mutex_lock(&pl->lock);
+    pl->free[pl->num_free++] = b;
+    pthread_cond_broadcast(&pl->changed);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+void io_reader_done(io_pipeline* pl) {
+    pthread_mutex_lock(&pl->lock);
+    pl->readers_left--;
+    pthread_cond_broadcast(&pl->changed);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+// Points buffer b at piece i: the piece's bytes plus the overlap in front of them
+void io_prepare(io_pipeline* pl, int b, int i) {
+    scan_piece* p = &pl->job->pieces[i];
+    io_buffer* buf = &pl->buffers[b];
+    long end = p->end == -1 ? pl->job->targets[p->target].size : p->end;
+    buf->piece = i;
+    buf->base = p->start > pl->keep ? p->start - pl->keep : 0;
+    buf->overlap = p->start - buf->base;
+    buf->length = end - buf->base;
+    buf->done = 0;
+    buf->error = 0;
+}
+
+void* io_matcher(void* arg) {
+    io_pipeline* pl = arg;
+    scan_job* job = pl->job;
+    scan_result scratch = {0};
+    int b;
+    while ((b = io_pop(pl)) != -1) {
+        io_buffer* buf = &pl->buffers[b];
+        reset_result(&scratch, job->max_hits);
+        if (buf->error) {
+            job->targets[job->pieces[buf->piece].target].failed = 1;
+        } else if (buf->length > buf->overlap) {
+#ifdef AV_PROFILE
+            double started = profile_now();
+#endif
+            scan_chunk(buf->data, buf->length, buf->base, buf->overlap, job->db, &scratch);
+#ifdef AV_PROFILE
+            job->pieces[buf->piece].seconds = profile_now() - started;
+#endif
+        }
+        store_piece_result(job, buf->piece, &scratch);
+        io_release(pl, b);
     }
-    
-    fclose(file);
+    free(scratch.locations);
+    return NULL;
+}
+
+// Reads buffer b with pread. A file that shrank since it was listed is matched up to
+// its new end.
+void io_read_sync(io_pipeline* pl, int b, int fd) {
+    io_buffer* buf = &pl->buffers[b];
+    ssize_t n = 1;
+    while (fd >= 0 && buf->done < buf->length
+            && (n = pread(fd, buf->data + buf->done, buf->length - buf->done, buf->base + buf->done)) > 0) {
+        buf->done += n;
+    }
+    buf->error |= fd < 0 || n < 0;
+    buf->length = buf->done;
 }
 
+// Reader threads: each claims whole targets and reads their pieces in order, so the
+// reads in flight are bounded by the number of readers
+void* io_thread_reader(void* arg) {
+    io_pipeline* pl = arg;
+    scan_job* job = pl->job;
+    for (;;) {
+        pthread_mutex_lock(&pl->lock);
+        int t = pl->next_target;
+        while (t < job->num_targets && pl->first_piece[t] == -1) t++;
+        pl->next_target = t + 1;
+        pthread_mutex_unlock(&pl->lock);
+        if (t >= job->num_targets) break;
 
-void list_print(link *virus_list, FILE* output) {
-    link *current = virus_list;
-    while (current != NULL) {
-        printVirus(current->vir, output);
-        current = current->nextVirus;
+        int fd = open(job->targets[t].path, O_RDONLY);
+        for (int i = pl->first_piece[t]; i < job->num_pieces && job->pieces[i].target == t; i++) {
+            int b = io_take(pl, 1);
+            io_prepare(pl, b, i);
+            io_read_sync(pl, b, fd);
+            io_push(pl, b);
+        }
+        if (fd >= 0) close(fd);
     }
+    io_reader_done(pl);
+    return NULL;
 }
 
-link* list_append(link* virus_list, virus* data) {
-    link* new_link = malloc(sizeof(link));
-    new_link->vir = data;
-    new_link->nextVirus = NULL;
-    
-    if (virus_list == NULL) {
-        return new_link;
+#ifdef HAVE_IO_URING
+void io_ring_free(io_ring* ring) {
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_size);
+    if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_size);
+    close(ring->fd);
+}
+
+// Creates a ring with room for entries requests. Returns -1 where io_uring is unavailable.
+int io_ring_setup(io_ring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+
+    ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        io_ring_free(ring);
+        return -1;
     }
-    
-    link* current = virus_list;
-    while (current->nextVirus != NULL) {
-        current = current->nextVirus;
+
+    char* sq = ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Queues a read of the rest of buffer b; io_uring_enter submits it
+void io_ring_queue(io_ring* ring, io_pipeline* pl, int b, int fd) {
+    io_buffer* buf = &pl->buffers[b];
+    buf->iov.iov_base = buf->data + buf->done;
+    buf->iov.iov_len = buf->length - buf->done;
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&buf->iov;
+    sqe->len = 1;
+    sqe->off = buf->base + buf->done;
+    sqe->user_data = b;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Hands a finished buffer to the matchers, closing its file after the last of its reads
+void io_ring_complete(io_pipeline* pl, int b) {
+    int t = pl->job->pieces[pl->buffers[b].piece].target;
+    if (--pl->reads_left[t] == 0 && pl->fds[t] >= 0) {
+        close(pl->fds[t]);
+        pl->fds[t] = -1;
     }
-    current->nextVirus = new_link;
-    return virus_list;
+    io_push(pl, b);
 }
 
-void list_free(link *virus_list) {
-    link *current = virus_list;
-    while (current != NULL) {
-        link *next = current->nextVirus;
-        free(current->vir->sig);
-        free(current->vir);
-        free(current);
-        current = next;
+// io_uring reader: one thread keeps up to inflight reads queued on the ring and hands each
+// buffer over as soon as its read completes. If the ring stops accepting requests, the
+// requests it did not take and everything after them are read with pread instead.
+void* io_uring_reader(void* arg) {
+    io_pipeline* pl = arg;
+    scan_job* job = pl->job;
+    io_ring* ring = &pl->ring;
+    int next = 0, inflight = 0, sync = 0, fd_target = -1;
+
+    while (next < job->num_pieces || inflight > 0) {
+        while (next < job->num_pieces && inflight < pl->inflight) {
+            // Only wait for a buffer when no completion can arrive instead
+            int b = io_take(pl, inflight == 0);
+            if (b == -1) break;
+            int i = next++;
+            int t = job->pieces[i].target;
+            if (t != fd_target) {
+                pl->fds[t] = open(job->targets[t].path, O_RDONLY);
+                fd_target = t;
+            }
+            io_prepare(pl, b, i);
+            if (sync || pl->fds[t] < 0 || pl->buffers[b].length == 0) {
+                io_read_sync(pl, b, pl->fds[t]);
+                io_ring_complete(pl, b);
+            } else {
+                io_ring_queue(ring, pl, b, pl->fds[t]);
+                inflight++;
+            }
+        }
+        if (inflight == 0) continue;
+
+        unsigned pending = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // Take back the requests the kernel has not seen and read them here
+            unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            for (unsigned k = head; k != *ring->sq_tail; k++) {
+                int b = ring->sqes[k & *ring->sq_mask].user_data;
+                io_read_sync(pl, b, pl->fds[job->pieces[pl->buffers[b].piece].target]);
+                io_ring_complete(pl, b);
+                inflight--;
+            }
+            __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+            sync = 1;
+            if (inflight > 0) sched_yield();
+        }
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            int b = cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+            inflight--;
+
+            io_buffer* buf = &pl->buffers[b];
+            if (res > 0 && buf->done + res < buf->length && !sync) {
+                // Short read: queue the rest
+                buf->done += res;
+                io_ring_queue(ring, pl, b, pl->fds[job->pieces[buf->piece].target]);
+                inflight++;
+                continue;
+            }
+            if (res > 0) buf->done += res;
+            if (res > 0 && buf->done < buf->length) {
+                io_read_sync(pl, b, pl->fds[job->pieces[buf->piece].target]);
+            }
+            buf->error |= res < 0;  // io_read_sync may already have failed the tail
+            buf->length = buf->done;
+            io_ring_complete(pl, b);
+        }
     }
+    io_reader_done(pl);
+    return NULL;
 }
+#endif
 
-link* load_signatures(char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        printf("Failed to open signatures file\n");
-        return NULL;
+// Scans the job's pieces through the read pipeline: readers fill buffers ahead of the
+// matching threads, which never block on I/O. Returns -1 if it cannot be set up.
+int run_pipeline(scan_job* job, scan_options* options, int num_threads) {
+    io_pipeline pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.job = job;
+    pl.inflight = options->inflight < 1 ? 1 : options->inflight;
+    pl.keep = job->db->max_size > 0 ? job->db->max_size - 1 : 0;
+    pl.num_buffers = pl.inflight + num_threads;
+    pl.buffers = calloc(pl.num_buffers, sizeof(io_buffer));
+    pl.free = malloc(pl.num_buffers * sizeof(int));
+    pl.queue = malloc(pl.num_buffers * sizeof(int));
+    pl.first_piece = malloc((job->num_targets + 1) * sizeof(int));
+    pl.fds = malloc((job->num_targets + 1) * sizeof(int));
+    pl.reads_left = calloc(job->num_targets + 1, sizeof(int));
+    int ok = pl.buffers && pl.free && pl.queue && pl.first_piece && pl.fds && pl.reads_left;
+    for (int b = 0; ok && b < pl.num_buffers; b++) {
+        pl.buffers[b].data = malloc(IO_CHUNK_SIZE + pl.keep);
+        ok = pl.buffers[b].data != NULL;
+        pl.free[pl.num_free++] = b;
     }
-    
-    if (!checkMagicNumber(file)) {
-        printf("Invalid magic number\n");
-        fclose(file);
-        return NULL;
+
+    int started = 0, matchers = 0;
+    pthread_t* threads = ok ? malloc((pl.inflight + num_threads) * sizeof(pthread_t)) : NULL;
+    if (threads != NULL) {
+        for (int t = 0; t < job->num_targets; t++) {
+            pl.first_piece[t] = -1;
+            pl.fds[t] = -1;
+        }
+        for (int i = job->num_pieces - 1; i >= 0; i--) {
+            pl.first_piece[job->pieces[i].target] = i;
+            pl.reads_left[job->pieces[i].target]++;
+        }
+        pthread_mutex_init(&pl.lock, NULL);
+        pthread_cond_init(&pl.changed, NULL);
+
+        void* (*reader)(void*) = io_thread_reader;
+        int num_readers = pl.inflight;
+#ifdef HAVE_IO_URING
+        if (options->io == IO_URING && io_ring_setup(&pl.ring, pl.inflight) == 0) {
+            reader = io_uring_reader;
+            num_readers = 1;
+        }
+#endif
+        pl.readers_left = num_readers;
+        for (int r = 0; r < num_readers; r++) {
+            if (pthread_create(&threads[started], NULL, reader, &pl) == 0) started++;
+            else io_reader_done(&pl);
+        }
+        for (; started > 0 && matchers < num_threads; matchers++) {
+            if (pthread_create(&threads[started + matchers], NULL, io_matcher, &pl) != 0) break;
+        }
+        if (started > 0 && matchers == 0) io_matcher(&pl);
+        for (int t = 0; t < started + matchers; t++) {
+            pthread_join(threads[t], NULL);
+        }
+#ifdef HAVE_IO_URING
+        if (reader == io_uring_reader) io_ring_free(&pl.ring);
+#endif
+        pthread_cond_destroy(&pl.changed);
+        pthread_mutex_destroy(&pl.lock);
     }
-    
-    link* virus_list = NULL;
-    virus* v;
-    while ((v = readVirus(file)) != NULL) {
-        virus_list = list_append(virus_list, v);
+
+    for (int b = 0; pl.buffers != NULL && b < pl.num_buffers; b++) free(pl.buffers[b].data);
+    free(pl.buffers);
+    free(pl.free);
+    free(pl.queue);
+    free(pl.first_piece);
+    free(pl.fds);
+    free(pl.reads_left);
+    free(threads);
+    return started > 0 ? 0 : -1;
+}
+
+#ifdef AV_PROFILE
+typedef struct profile_row {
+    int sig;
+    sig_profile total;
+} profile_row;
+
+typedef struct file_row {
+    int target;
+    double seconds;
+} file_row;
+
+// Most comparisons first, then most candidates: the signatures that cost the most
+int compare_profile_rows(const void* a, const void* b) {
+    const sig_profile* x = &((const profile_row*)a)->total;
+    const sig_profile* y = &((const profile_row*)b)->total;
+    if (x->comparisons != y->comparisons) return x->comparisons < y->comparisons ? 1 : -1;
+    if (x->candidates != y->candidates) return x->candidates < y->candidates ? 1 : -1;
+    return x->hits < y->hits ? 1 : x->hits > y->hits ? -1 : 0;
+}
+
+int compare_file_rows(const void* a, const void* b) {
+    double x = ((const file_row*)a)->seconds, y = ((const file_row*)b)->seconds;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Writes the merged counters of every thread for db, sorted by cost, and the time spent
+// matching each target, slowest first. Text or JSON lines like the scan report.
+void profile_report(sig_db* db, scan_job* job, const char* path, int json) {
+    FILE* file = fopen(path, "w");
+    profile_row* rows = calloc(db->count, sizeof(profile_row));
+    file_row* files = calloc(job->num_targets + 1, sizeof(file_row));
+    if (file == NULL || rows == NULL || files == NULL) {
+        fprintf(stderr, "Failed to write profile %s\n", path);
+        if (file != NULL) fclose(file);
+        free(rows);
+        free(files);
+        return;
     }
-    
+
+    for (int n = 0; n < db->count; n++) rows[n].sig = n;
+    pthread_mutex_lock(&profile_lock);
+    for (profile_block* block = profile_blocks; block != NULL; block = block->next) {
+        if (block->db != db) continue;
+        for (int n = 0; n < block->count; n++) {
+            rows[n].total.candidates += block->counters[n].candidates;
+            rows[n].total.comparisons += block->counters[n].comparisons;
+            rows[n].total.hits += block->counters[n].hits;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+    qsort(rows, db->count, sizeof(profile_row), compare_profile_rows);
+
+    for (int t = 0; t < job->num_targets; t++) files[t].target = t;
+    for (int i = 0; i < job->num_pieces; i++) files[job->pieces[i].target].seconds += job->pieces[i].seconds;
+    qsort(files, job->num_targets, sizeof(file_row), compare_file_rows);
+
+    static out_writer w;
+    writer_init(&w, file, json);
+    if (!json) writer_str(&w, "candidates comparisons hits name\n");
+    for (int n = 0; n < db->count && rows[n].total.candidates > 0; n++) {
+        const sig_profile* c = &rows[n].total;
+        const char* name = db->viruses[rows[n].sig].virusName;
+        writer_str(&w, json ? "{\"signature\":" : "");
+        if (json) writer_json_str(&w, name, 16);
+        writer_str(&w, json ? ",\"candidates\":" : "");
+        writer_long(&w, c->candidates);
+        writer_str(&w, json ? ",\"comparisons\":" : " ");
+        writer_long(&w, c->comparisons);
+        writer_str(&w, json ? ",\"hits\":" : " ");
+        writer_long(&w, c->hits);
+        if (json) {
+            writer_str(&w, "}\n");
+        } else {
+            writer_str(&w, " ");
+            writer_bytes(&w, name, strnlen(name, 16));
+            writer_str(&w, "\n");
+        }
+    }
+
+    if (!json) writer_str(&w, "\nmicroseconds bytes path\n");
+    for (int t = 0; t < job->num_targets; t++) {
+        scan_target* target = &job->targets[files[t].target];
+        if (target->cached) continue;
+        writer_str(&w, json ? "{\"file\":" : "");
+        if (json) writer_json_str(&w, target->path, strlen(target->path));
+        writer_str(&w, json ? ",\"microseconds\":" : "");
+        writer_long(&w, (long)(files[t].seconds * 1e6));
+        writer_str(&w, json ? ",\"bytes\":" : " ");
+        writer_long(&w, target->size);
+        if (json) {
+            writer_str(&w, "}\n");
+        } else {
+            writer_str(&w, " ");
+            writer_str(&w, target->path);
+            writer_str(&w, "\n");
+        }
+    }
+    writer_flush(&w);
     fclose(file);
-    return virus_list;
+    free(rows);
+    free(files);
+}
+#endif
+
+// Non-interactive scan of every file under dirName. Detections are reported ordered by path.
+// Returns 1 if anything was detected, 0 if not, or -1 if the scan could not run.
+int scan_directory(char* dirName, sig_db* db, scan_options* options) {
+    scan_target* targets = NULL;
+    int count = 0, capacity = 0;
+    collect_targets(dirName, &targets, &count, &capacity);
+    qsort(targets, count, sizeof(scan_target), compare_targets);
+    return scan_targets(targets, count, db, options);
+}
+
+// Scans every target on worker threads sharing the compiled signatures and prints one
+// record per detection, in target order and then by offset, followed by a summary.
+// Takes ownership of targets. Returns 1 if anything was detected, 0 if not, or -1 if
+// the scan could not run.
+int scan_targets(scan_target* targets, int num_targets, sig_db* db, scan_options* options) {
+    scan_job job = {0};
+    job.targets = targets;
+    job.num_targets = num_targets;
+
+    // Files whose clean verdict is still cached get no pieces at all
+    verdict_cache* cache = NULL;
+    if (options->cache_path != NULL) {
+        cache = cache_open(options->cache_path, db_fingerprint(db));
+        if (cache == NULL) fprintf(stderr, "Failed to open cache %s, scanning without it\n", options->cache_path);
+    }
+    for (int i = 0; cache != NULL && i < job.num_targets; i++) {
+        if (!job.targets[i].failed) job.targets[i].cached = cache_lookup(cache, &job.targets[i], options->cache_digest);
+    }
+
+    // Large files become several ranges so one big file cannot starve the other workers.
+    // The read pipeline reads every file in chunks that fit its buffers.
+    long split = options->io == IO_MMAP ? SPLIT_FILE_SIZE : IO_CHUNK_SIZE;
+    long range = options->io == IO_MMAP ? RANGE_SIZE : IO_CHUNK_SIZE;
+    int max_pieces = 0;
+    for (int i = 0; i < job.num_targets; i++) {
+        if (job.targets[i].cached) continue;
+        long size = job.targets[i].size;
+        max_pieces += size > split ? (size + range - 1) / range : 1;
+    }
+    job.pieces = malloc((max_pieces + 1) * sizeof(scan_piece));
+    job.results = calloc(max_pieces + 1, sizeof(scan_result));
+    if (job.pieces == NULL || job.results == NULL) {
+        free(job.pieces);
+        free(job.results);
+        for (int i = 0; i < job.num_targets; i++) free(job.targets[i].path);
+        free(job.targets);
+        if (cache != NULL) cache_close(cache);
+        return -1;
+    }
+    for (int i = 0; i < job.num_targets; i++) {
+        if (job.targets[i].cached) continue;
+        long size = job.targets[i].size;
+        if (size <= split) {
+            job.pieces[job.num_pieces++] = (scan_piece){i, 0, -1};
+            continue;
+        }
+        for (long start = 0; start < size; start += range) {
+            long end = start + range < size ? start + range : -1;
+            job.pieces[job.num_pieces++] = (scan_piece){i, start, end};
+        }
+    }
+
+    job.db = db;
+    job.max_hits = options->max_hits;
+    pthread_mutex_init(&job.lock, NULL);
+    int num_threads = options->num_threads < 1 ? 1 : options->num_threads;
+    if (options->io == IO_MMAP || run_pipeline(&job, options, num_threads) != 0) {
+        pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+        int started = 0;
+        for (; threads != NULL && started < num_threads; started++) {
+            if (pthread_create(&threads[started], NULL, scan_worker, &job) != 0) break;
+        }
+        if (started == 0) {
+            scan_worker(&job);
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    // Pieces are in path order; the ranges of a split file are merged before sorting because
+    // a detection belongs to the range it ends in, not the one it starts in
+    static out_writer w;
+    writer_init(&w, stdout, options->json);
+    long total = 0, listed = 0;
+    for (int i = 0; i < job.num_pieces; i++) {
+        scan_result* r = &job.results[i];
+        int target = job.pieces[i].target;
+        r->max_hits = 0;
+        while (i + 1 < job.num_pieces && job.pieces[i + 1].target == target) {
+            scan_result* next = &job.results[++i];
+            long seen = r->total;
+            for (int j = 0; j < next->count; j++) {
+                report_location(r, &next->locations[j]);
+            }
+            r->total = seen + next->total;
+            r->dropped += next->dropped;
+            free(next->locations);
+        }
+
+        qsort(r->locations, r->count, sizeof(virus_location), compare_locations);
+        if (options->max_hits > 0 && r->count > options->max_hits) {
+            r->count = options->max_hits;
+        }
+        for (int j = 0; j < r->count; j++) {
+            write_detection(&w, job.targets[target].path, &r->locations[j]);
+        }
+        if (r->dropped > 0) job.targets[target].failed = 1;
+        if (cache != NULL && r->total == 0 && !job.targets[target].failed) {
+            cache_store(cache, &job.targets[target], options->cache_digest);
+        }
+        total += r->total;
+        listed += r->count;
+        free(r->locations);
+    }
+
+    // Files answered from the cache were never read, so their bytes are counted apart
+    int failed = 0;
+    long bytes = 0, cached_bytes = 0;
+    for (int i = 0; i < job.num_targets; i++) {
+        if (job.targets[i].failed) {
+            fprintf(stderr, "Failed to scan %s\n", job.targets[i].path);
+            failed++;
+        } else if (job.targets[i].cached) {
+            cached_bytes += job.targets[i].size;
+        } else {
+            bytes += job.targets[i].size;
+        }
+    }
+    if (options->json) {
+        writer_str(&w, "{\"summary\":{\"files\":");
+        writer_long(&w, job.num_targets - failed);
+        writer_str(&w, ",\"bytes\":");
+        writer_long(&w, bytes);
+        writer_str(&w, ",\"failed\":");
+        writer_long(&w, failed);
+        writer_str(&w, ",\"detections\":");
+        writer_long(&w, total);
+        writer_str(&w, ",\"listed\":");
+        writer_long(&w, listed);
+        if (cache != NULL) {
+            writer_str(&w, ",\"cache_hits\":");
+            writer_long(&w, cache->hits);
+            writer_str(&w, ",\"cache_misses\":");
+            writer_long(&w, cache->misses);
+            writer_str(&w, ",\"cached_bytes\":");
+            writer_long(&w, cached_bytes);
+        }
+        writer_str(&w, "}}\n");
+    } else {
+        writer_str(&w, "Scanned ");
+        writer_long(&w, job.num_targets - failed);
+        writer_str(&w, " files (");
+        writer_long(&w, bytes);
+        writer_str(&w, " bytes), ");
+        writer_long(&w, failed);
+        writer_str(&w, " failed, ");
+        writer_long(&w, total);
+        writer_str(&w, " viruses detected");
+        if (listed < total) {
+            writer_str(&w, ", ");
+            writer_long(&w, total - listed);
+            writer_str(&w, " over the per-file limit not listed");
+        }
+        writer_str(&w, "\n");
+        if (cache != NULL) {
+            writer_str(&w, "Cache: ");
+            writer_long(&w, cache->hits);
+            writer_str(&w, " hits (");
+            writer_long(&w, cached_bytes);
+            writer_str(&w, " bytes not read), ");
+            writer_long(&w, cache->misses);
+            writer_str(&w, " misses (lifetime ");
+            writer_long(&w, cache->hdr->hits + cache->hits);
+            writer_str(&w, " hits, ");
+            writer_long(&w, cache->hdr->misses + cache->misses);
+            writer_str(&w, " misses)\n");
+        }
+    }
+    writer_flush(&w);
+    if (cache != NULL) cache_close(cache);
+#ifdef AV_PROFILE
+    if (options->profile_path != NULL) profile_report(db, &job, options->profile_path, options->json);
+#endif
+
+    for (int i = 0; i < job.num_targets; i++) free(job.targets[i].path);
+
+    free(job.targets);
+    free(job.pieces);
+    free(job.results);
+    return total > 0;
 }
 
 void print_menu() {
@@ -223,8 +3011,220 @@ void print_menu() {
     printf("Please choose an option: ");
 }
 
-int main() {
-    link* virus_list = NULL;
+// Parses the options shared by the batch modes starting at argv[*i], leaving *i at the
+// first argument that is not one of them
+void parse_scan_options(int argc, char **argv, int* i, scan_options* options) {
+    for (; *i < argc && argv[*i][0] == '-'; (*i)++) {
+        if (strcmp(argv[*i], "-j") == 0 && *i + 1 < argc) {
+            options->num_threads = atoi(argv[++*i]);
+        } else if (strcmp(argv[*i], "--max-hits") == 0 && *i + 1 < argc) {
+            options->max_hits = atoi(argv[++*i]);
+        } else if (strcmp(argv[*i], "--json") == 0) {
+            options->json = 1;
+        } else if (strcmp(argv[*i], "--cache") == 0 && *i + 1 < argc) {
+            options->cache_path = argv[++*i];
+        } else if (strcmp(argv[*i], "--cache-digest") == 0) {
+            options->cache_digest = 1;
+        } else if (strcmp(argv[*i], "--inflight") == 0 && *i + 1 < argc) {
+            options->inflight = atoi(argv[++*i]);
+#ifdef AV_PROFILE
+        } else if (strcmp(argv[*i], "--profile") == 0 && *i + 1 < argc) {
+            options->profile_path = argv[++*i];
+#endif
+        } else if (strcmp(argv[*i], "--io") == 0 && *i + 1 < argc) {
+            const char* io = argv[++*i];
+            options->io = strcmp(io, "uring") == 0 ? IO_URING : strcmp(io, "threads") == 0 ? IO_THREADS : IO_MMAP;
+        } else {
+            break;
+        }
+    }
+}
+
+// AntiVirus scan [-j threads] [--json] [--max-hits n] [--cache file [--cache-digest]]
+//     [--io mmap|uring|threads] [--inflight n] <signatures> <dir>
+int scan_command(int argc, char **argv) {
+    scan_options options = {get_nprocs(), 0, DEFAULT_MAX_HITS, NULL, 0, IO_MMAP, IO_DEFAULT_INFLIGHT};
+    int i = 2;
+    parse_scan_options(argc, argv, &i, &options);
+    if (argc - i != 2) {
+        fprintf(stderr, "Usage: %s scan [-j threads] [--json] [--max-hits n] [--cache file [--cache-digest]]"
+            " [--io mmap|uring|threads] [--inflight n] <signatures> <dir>\n", argv[0]);
+        return 2;
+    }
+
+    sig_db* db = load_signatures(argv[i]);
+    if (db == NULL) {
+        return 2;
+    }
+    int found = scan_directory(argv[i + 1], db, &options);
+    list_free(db);
+    return found < 0 ? 2 : found;
+}
+
+// Reads paths separated by delim (newline or NUL) into targets, in input order.
+// Paths that cannot be stat'ed are kept and reported as failed by the scan.
+void read_targets(FILE* list, int delim, scan_target** targets, int* count, int* capacity) {
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &line_size, delim, list)) > 0) {
+        if (line[len - 1] == delim) line[--len] = '\0';
+        if (len == 0) continue;
+
+        struct stat st;
+        int ok = stat(line, &st) == 0;
+        if (add_scan_target(targets, count, capacity, line, ok ? &st : NULL) != 0) break;
+        if (!ok || S_ISDIR(st.st_mode)) (*targets)[*count - 1].failed = 1;
+    }
+    free(line);
+}
+
+// AntiVirus -s <signatures> (-f <list> | -0) [-j threads] [--json] [--max-hits n] [--cache file [--cache-digest]]
+//     [--io mmap|uring|threads] [--inflight n]
+// Loads the signatures once and scans every listed file. The list holds one path per line,
+// "-f -" reads it from stdin, and -0 reads NUL-separated paths from stdin.
+int batch_command(int argc, char **argv) {
+    scan_options options = {get_nprocs(), 0, DEFAULT_MAX_HITS, NULL, 0, IO_MMAP, IO_DEFAULT_INFLIGHT};
+    char* sig_file = NULL;
+    char* list_file = NULL;
+    int delim = '\n';
+    int i = 1;
+    while (i < argc) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            sig_file = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            list_file = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "-0") == 0) {
+            list_file = "-";
+            delim = '\0';
+            i++;
+        } else {
+            int before = i;
+            parse_scan_options(argc, argv, &i, &options);
+            if (i == before) break;
+        }
+    }
+    if (i != argc || sig_file == NULL || list_file == NULL) {
+        fprintf(stderr, "Usage: %s -s <signatures> (-f <list> | -0) [-j threads] [--json] [--max-hits n] [--cache file [--cache-digest]]"
+            " [--io mmap|uring|threads] [--inflight n]\n", argv[0]);
+        return 2;
+    }
+
+    FILE* list = strcmp(list_file, "-") == 0 ? stdin : fopen(list_file, "r");
+    if (list == NULL) {
+        fprintf(stderr, "Failed to open file list %s\n", list_file);
+        return 2;
+    }
+    sig_db* db = load_signatures(sig_file);
+    if (db == NULL) {
+        if (list != stdin) fclose(list);
+        return 2;
+    }
+
+    scan_target* targets = NULL;
+    int count = 0, capacity = 0;
+    read_targets(list, delim, &targets, &count, &capacity);
+    if (list != stdin) fclose(list);
+
+    int found = scan_targets(targets, count, db, &options);
+    list_free(db);
+    return found < 0 ? 2 : found;
+}
+
+// AntiVirus fix [--journal file] <signatures> <file>...
+// AntiVirus undo <journal>
+int fix_command(int argc, char **argv) {
+    if (strcmp(argv[1], "undo") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s undo <journal>\n", argv[0]);
+            return 2;
+        }
+        return undo_journal(argv[2]) == 0 ? 0 : 2;
+    }
+
+    char* journal_name = NULL;
+    int i = 2;
+    if (i + 1 < argc && strcmp(argv[i], "--journal") == 0) {
+        journal_name = argv[i + 1];
+        i += 2;
+    }
+    if (argc - i < 2) {
+        fprintf(stderr, "Usage: %s fix [--journal file] <signatures> <file>...\n", argv[0]);
+        return 2;
+    }
+
+    sig_db* db = load_signatures(argv[i]);
+    if (db == NULL) {
+        return 2;
+    }
+    FILE* journal = NULL;
+    if (journal_name != NULL && (journal = fopen(journal_name, "ab")) == NULL) {
+        printf("Failed to open journal %s\n", journal_name);
+        list_free(db);
+        return 2;
+    }
+
+    int status = 0;
+    scan_result result = {0};
+    for (i++; i < argc; i++) {
+        reset_result(&result, 0);
+        if (scan_file(argv[i], db, &result) != 0 || neutralize_viruses(argv[i], &result, journal) < 0) {
+            printf("Failed to fix %s\n", argv[i]);
+            status = 2;
+        }
+    }
+
+    free(result.locations);
+    if (journal != NULL) fclose(journal);
+    list_free(db);
+    return status;
+}
+
+// AntiVirus compile-sigs <signatures> <output>
+int compile_command(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s compile-sigs <signatures> <output>\n", argv[0]);
+        return 2;
+    }
+    sig_db* db = load_signatures(argv[2]);
+    if (db == NULL) {
+        return 2;
+    }
+    int failed = compile_signatures(db, argv[3]);
+    list_free(db);
+    return failed ? 2 : 0;
+}
+
+#ifndef AV_NO_MAIN
+int main(int argc, char **argv) {
+    // Global options come before the command: AntiVirus [--engine aho|hash|naive] [command ...]
+    while (argc > 2 && strcmp(argv[1], "--engine") == 0) {
+        if (set_engine(argv[2]) != 0) {
+            fprintf(stderr, "Unknown engine %s, expected aho, hash or naive\n", argv[2]);
+            return 2;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+        return scan_command(argc, argv);
+    }
+    if (argc > 1 && argv[1][0] == '-') {
+        return batch_command(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "compile-sigs") == 0) {
+        return compile_command(argc, argv);
+    }
+    if (argc > 1 && (strcmp(argv[1], "fix") == 0 || strcmp(argv[1], "undo") == 0)) {
+        return fix_command(argc, argv);
+    }
+
+    sig_db* db = NULL;
+    scan_result result = {0};  // reused by every scan
     char buffer[BUFFER_SIZE];
     int option;
     
@@ -238,16 +3238,16 @@ int main() {
                 printf("Enter signatures file name: ");
                 fgets(buffer, BUFFER_SIZE, stdin);
                 buffer[strcspn(buffer, "\n")] = 0;
-                if (virus_list != NULL) {
-                    list_free(virus_list);
+                if (db != NULL) {
+                    list_free(db);
                 }
-                virus_list = load_signatures(buffer);
+                db = load_signatures(buffer);
                 break;
             }
             case 2: {
-                if (virus_list != NULL) {
+                if (db != NULL) {
                     printf("Printing signatures:\n");
-                    list_print(virus_list, stdout);
+                    list_print(db, stdout);
                 } else {
                     printf("No signatures loaded\n");
                 }
@@ -259,21 +3259,13 @@ int main() {
                 fgets(filename, 100, stdin);
                 filename[strcspn(filename, "\n")] = 0;
 
-                FILE *suspected = fopen(filename, "rb");
-                if (suspected == NULL) {
-                    printf("Failed to open suspected file\n");
-                    break;
-                }
-
-                // Read file content into buffer
-                char buffer[BUFFER_SIZE];
-                size_t bytesRead = fread(buffer, 1, BUFFER_SIZE, suspected);
-                fclose(suspected);
-                
-                if (bytesRead > 0 && virus_list != NULL) {
-                    virus_location locations[10];
-                    int count = 0;
-                    detect_virus(buffer, bytesRead, virus_list, locations, &count);
+                if (db != NULL) {
+                    reset_result(&result, DEFAULT_MAX_HITS);
+                    if (scan_file(filename, db, &result) == 0) {
+                        print_detections(&result);
+                    } else {
+                        printf("Failed to scan suspected file\n");
+                    }
                 }
                 break;
             }
@@ -285,36 +3277,26 @@ int main() {
                 fgets(filename, 100, stdin);
                 filename[strcspn(filename, "\n")] = 0;
 
-                FILE *suspected = fopen(filename, "rb");
-                if (suspected == NULL) {
-                    printf("Failed to open suspected file\n");
-                    break;
-                }
+                if (db != NULL) {
+                    // Uncapped like the fix command: every detection gets neutralized
+                    reset_result(&result, 0);
+                    if (scan_file(filename, db, &result) != 0) {
+                        printf("Failed to scan suspected file\n");
+                        break;
+                    }
+                    print_detections(&result);
 
-                // Read and scan file for viruses
-                char buffer[BUFFER_SIZE];
-                size_t bytesRead = fread(buffer, 1, BUFFER_SIZE, suspected);
-                fclose(suspected);
-                
-                if (bytesRead > 0 && virus_list != NULL) {
-                    virus_location locations[10];
-                    int count = 0;
-                    detect_virus(buffer, bytesRead, virus_list, locations, &count);
-                    
                     // Neutralize all detected viruses
-                    for (int i = 0; i < count; i++) {
-                        printf("Neutralizing virus: %s at offset %d\n", 
-                            locations[i].name, locations[i].offset);
-                        neutralize_virus(filename, locations[i].offset);
-                    }
+                    neutralize_viruses(filename, &result, NULL);
                 }
                 break;
             }
 
             case 5:
-                if (virus_list != NULL) {
-                    list_free(virus_list);
+                if (db != NULL) {
+                    list_free(db);
                 }
+                free(result.locations);
                 exit(0);
             default:
                 printf("Invalid option\n");
@@ -323,3 +3305,4 @@ int main() {
     
     return 0;
 }
+#endif
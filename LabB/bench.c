@@ -0,0 +1,340 @@
+// Compares the naive memcmp matcher with the Aho-Corasick automaton and the
+// hash index at 10, 1k and 100k random signatures, and measures the SIMD prefilter
+// on random and adversarial input, and a family of near-duplicate signatures against
+// the one masked signature covering them.
+//   ./bench [engines|prefilter|patterns]
+// The suite generates VIRL and VIRB signature files and suspect files with planted hits
+// under dir, then times loading, detection and neutralization, one JSON line per run.
+//   ./bench suite [dir]
+#define AV_NO_MAIN
+#include "AntiVirus.c"
+
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define SCAN_SIZE (16 * 1024 * 1024)
+#define NAIVE_WORK 400000000.0  // signature*byte comparisons per naive run
+#define PREFILTER_SIZE (64 * 1024 * 1024)
+#define SUITE_SUSPECT_SIZE (16L * 1024 * 1024)
+#define SUITE_PLANTED 1000  // signatures planted in every suspect file
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Random signatures of 8..31 bytes
+sig_db* random_signatures(int n) {
+    sig_db* db = calloc(1, sizeof(sig_db));
+    db->bytes = malloc(n * 32);
+    for (int i = 0; i < n; i++) {
+        virus v = {0};
+        v.SigSize = 8 + rand() % 24;
+        snprintf(v.virusName, 16, "sig%d", i);
+        unsigned char* sig = db->bytes + db->num_bytes;
+        for (int j = 0; j < v.SigSize; j++) sig[j] = rand();
+        list_append(db, &v, sig);
+    }
+    return db;
+}
+
+void bench_engines() {
+    int counts[] = {10, 1000, 100000};
+    char* buffer = malloc(SCAN_SIZE);
+    scan_result result = {0};
+
+    for (int i = 0; i < SCAN_SIZE; i++) buffer[i] = rand();
+
+    printf("%-10s %-8s %12s %12s %10s\n", "sigs", "engine", "bytes", "seconds", "MB/s");
+    for (int k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+        int n = counts[k];
+        sig_db* db = random_signatures(n);
+
+        // Keep the naive run bounded: it costs signatures x bytes
+        unsigned int naive_size = NAIVE_WORK / n;
+        if (naive_size > SCAN_SIZE) naive_size = SCAN_SIZE;
+        double t = now_sec();
+        detect_virus_naive(buffer, naive_size, db, &result);
+        t = now_sec() - t;
+        printf("%-10d %-8s %12u %12.4f %10.1f\n", n, "naive", naive_size, t, naive_size / t / 1e6);
+
+        t = now_sec();
+        ac_build(&db->matcher, db);
+        double build = now_sec() - t;
+        t = now_sec();
+        detect_virus(buffer, SCAN_SIZE, db, &result);
+        t = now_sec() - t;
+        printf("%-10d %-8s %12u %12.4f %10.1f  (build %.4fs, %d states)\n",
+            n, "aho", SCAN_SIZE, t, SCAN_SIZE / t / 1e6, build, db->matcher.num_nodes);
+
+        hash_build(&db->index, db);
+        scan_engine = ENGINE_HASH;
+        t = now_sec();
+        detect_virus(buffer, SCAN_SIZE, db, &result);
+        t = now_sec() - t;
+        scan_engine = ENGINE_AHO;
+        printf("%-10d %-8s %12u %12.4f %10.1f\n", n, "hash", SCAN_SIZE, t, SCAN_SIZE / t / 1e6);
+
+        list_free(db);
+    }
+
+    free(result.locations);
+    free(buffer);
+}
+
+// One scan of buffer with the given prefilter search, NULL meaning no prefilter
+void time_prefilter(sig_db* db, const char* input, const char* name, char* buffer,
+        unsigned int (*find)(const prefilter*, const unsigned char*, unsigned int, unsigned int)) {
+    prefilter saved = db->filter;
+    if (find == NULL) db->filter.num_bytes = 0;
+    else prefilter_find = find;
+
+    scan_result result = {0};
+    double t = now_sec();
+    detect_virus(buffer, PREFILTER_SIZE, db, &result);
+    t = now_sec() - t;
+    printf("%-12s %-8s %10.4f %8.2f %8d\n", input, name, t, PREFILTER_SIZE / t / 1e9, result.count);
+
+    free(result.locations);
+    db->filter = saved;
+}
+
+void bench_prefilter() {
+    sig_db* db = random_signatures(1);
+    ac_build(&db->matcher, db);
+    prefilter_build(db);
+    unsigned int (*best)(const prefilter*, const unsigned char*, unsigned int, unsigned int) = prefilter_find;
+
+    char* buffer = malloc(PREFILTER_SIZE);
+    printf("\n%-12s %-8s %10s %8s %8s\n", "input", "engine", "seconds", "GB/s", "hits");
+    for (int adversarial = 0; adversarial < 2; adversarial++) {
+        const char* input = adversarial ? "adversarial" : "random";
+        // Adversarial input repeats the prefilter byte pair, so every other byte is a candidate
+        for (int i = 0; i < PREFILTER_SIZE; i++) {
+            if (!adversarial) buffer[i] = rand();
+            else buffer[i] = (i % 2 == 0) ? db->filter.bytes[0] : db->filter.next;
+        }
+
+        time_prefilter(db, input, "none", buffer, NULL);
+        time_prefilter(db, input, "scalar", buffer, prefilter_find_scalar);
+#ifdef HAVE_X86_SIMD
+        time_prefilter(db, input, "sse2", buffer, prefilter_find_sse2);
+        if (best == prefilter_find_avx2) {
+            time_prefilter(db, input, "avx2", buffer, prefilter_find_avx2);
+        }
+#endif
+    }
+    prefilter_find = best;
+
+    free(buffer);
+    list_free(db);
+}
+
+// 4096 variants of a 16-byte signature that differ in bytes 5 and 11, as plain records
+// or as one pattern with "??" in those places
+sig_db* family_signatures(int masked) {
+    const char* text = "4D 5A 90 00 03 ?? 00 00 04 00 00 ?? FF FF 00 00";
+    sig_db* db = calloc(1, sizeof(sig_db));
+    virus v = {0};
+    if (masked) {
+        snprintf(v.virusName, 16, "family");
+        list_append(db, &v, pattern_compile(text, strlen(text), db, &v));
+    } else {
+        for (int i = 0; i < 4096; i++) {
+            unsigned char* sig = arena_reserve(db, 16);
+            for (int j = 0; j < 16; j++) sig[j] = hex_digit(text[3 * j]) << 4 | hex_digit(text[3 * j + 1]);
+            sig[5] = i & 63;
+            sig[11] = i >> 6;
+            v.SigSize = 16;
+            snprintf(v.virusName, 16, "family%d", i);
+            list_append(db, &v, sig);
+        }
+    }
+    ac_build(&db->matcher, db);
+    prefilter_build(db);
+    return db;
+}
+
+void bench_patterns() {
+    char* buffer = malloc(SCAN_SIZE);
+    for (int i = 0; i < SCAN_SIZE; i++) buffer[i] = rand();
+    // Plant members of the family that both databases cover
+    for (int i = 0; i < 1000; i++) {
+        unsigned char member[16] = {0x4D, 0x5A, 0x90, 0, 3, i & 63, 0, 0, 4, 0, 0, (i >> 6) & 63, 0xFF, 0xFF, 0, 0};
+        memcpy(buffer + (long)i * (SCAN_SIZE / 1000), member, 16);
+    }
+
+    printf("\n%-8s %8s %10s %10s %8s %8s\n", "sigs", "records", "db bytes", "seconds", "MB/s", "hits");
+    for (int masked = 0; masked < 2; masked++) {
+        sig_db* db = family_signatures(masked);
+        scan_result result = {0};
+        double t = now_sec();
+        detect_virus(buffer, SCAN_SIZE, db, &result);
+        t = now_sec() - t;
+        printf("%-8s %8d %10zu %10.4f %8.1f %8d\n", masked ? "masked" : "plain",
+            db->count, db->num_bytes, t, SCAN_SIZE / t / 1e6, result.count);
+        free(result.locations);
+        list_free(db);
+    }
+    free(buffer);
+}
+
+// Writes the records of db as a VIRL or VIRB signature file
+int write_signature_file(const char* path, sig_db* db, int big_endian) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return -1;
+    fwrite(big_endian ? "VIRB" : "VIRL", 1, 4, file);
+    for (virus* v = db->viruses; v < db->viruses + db->count; v++) {
+        unsigned char size[2] = {v->SigSize & 0xFF, v->SigSize >> 8};
+        if (big_endian) {
+            size[0] = v->SigSize >> 8;
+            size[1] = v->SigSize & 0xFF;
+        }
+        fwrite(size, 1, 2, file);
+        fwrite(v->virusName, 1, 16, file);
+        fwrite(db->bytes + v->offset, 1, v->SigSize, file);
+    }
+    return fclose(file);
+}
+
+// Random bytes with SUITE_PLANTED signatures of db spread evenly through them
+int write_suspect_file(const char* path, sig_db* db, long size) {
+    unsigned char* data = malloc(size);
+    if (data == NULL) return -1;
+    for (long i = 0; i < size; i++) data[i] = rand();
+    for (int i = 0; i < SUITE_PLANTED; i++) {
+        virus* v = &db->viruses[rand() % db->count];
+        memcpy(data + i * (size / SUITE_PLANTED), db->bytes + v->offset, v->SigSize);
+    }
+    FILE* file = fopen(path, "wb");
+    int failed = file == NULL || fwrite(data, 1, size, file) != size;
+    if (file != NULL && fclose(file) != 0) failed = 1;
+    free(data);
+    return failed ? -1 : 0;
+}
+
+long file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+// count is the number of signatures loaded or of detections found
+void report_run(const char* bench, const char* format, int sigs, long bytes, double seconds, long count) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("{\"bench\":\"%s\",\"format\":\"%s\",\"sigs\":%d,\"bytes\":%ld,\"seconds\":%.6f,"
+        "\"mb_per_s\":%.2f,\"ns_per_byte\":%.3f,\"count\":%ld,\"peak_rss_kb\":%ld}\n",
+        bench, format, sigs, bytes, seconds, bytes / seconds / 1e6, seconds * 1e9 / bytes,
+        count, usage.ru_maxrss);
+    fflush(stdout);
+}
+
+// Times one operation in a child process, so each reported peak RSS is its own
+void suite_run(const char* bench, const char* format, int sigs, const char* sig_path, const char* suspect) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid > 0) waitpid(pid, NULL, 0);
+        return;
+    }
+
+    double t = now_sec();
+    sig_db* db = load_signatures((char*)sig_path);
+    double load = now_sec() - t;
+    if (db == NULL) _exit(1);
+    if (strcmp(bench, "load") == 0) {
+        report_run(bench, format, sigs, file_size(sig_path), load, db->count);
+        _exit(0);
+    }
+
+    long size = file_size(suspect);
+    scan_result result = {0};
+    if (strcmp(bench, "detect") == 0) {
+        // detect_virus on the file read into memory, as the interactive menu does
+        char* buffer = malloc(size);
+        FILE* file = fopen(suspect, "rb");
+        if (buffer == NULL || file == NULL || fread(buffer, 1, size, file) != size) _exit(1);
+        fclose(file);
+        t = now_sec();
+        detect_virus(buffer, size, db, &result);
+        report_run(bench, format, sigs, size, now_sec() - t, result.total);
+    } else if (strcmp(bench, "scan") == 0) {
+        t = now_sec();
+        scan_file((char*)suspect, db, &result);
+        report_run(bench, format, sigs, size, now_sec() - t, result.total);
+    } else {
+        // Neutralize a copy so the suspect file keeps its hits for the next run
+        char copy[4096];
+        snprintf(copy, sizeof(copy), "%s.fix", suspect);
+        char command[8300];
+        snprintf(command, sizeof(command), "cp '%s' '%s'", suspect, copy);
+        if (system(command) != 0) _exit(1);
+        scan_file(copy, db, &result);
+        // neutralize_viruses reports on stdout, which carries the JSON lines
+        int saved = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        t = now_sec();
+        neutralize_viruses(copy, &result, NULL);
+        t = now_sec() - t;
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        report_run(bench, format, sigs, size, t, result.count);
+        unlink(copy);
+    }
+    _exit(0);
+}
+
+// Writes the signature files and suspect file for n signatures. Runs in its own process
+// like the measurements, so the generator's memory does not count towards their peak RSS.
+int write_corpus(int n, const char* virl, const char* virb, const char* suspect) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sig_db* db = random_signatures(n);
+        int failed = write_signature_file(virl, db, 0) != 0
+            || write_signature_file(virb, db, 1) != 0
+            || write_suspect_file(suspect, db, SUITE_SUSPECT_SIZE) != 0;
+        _exit(failed);
+    }
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Generates the corpus under dir and runs every measurement on it
+void bench_suite(const char* dir) {
+    int counts[] = {100, 10000, 100000};
+    char virl[4096], virb[4096], suspect[4096];
+    mkdir(dir, 0755);
+
+    for (int k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+        int n = counts[k];
+        snprintf(virl, sizeof(virl), "%s/sigs_%d_VIRL", dir, n);
+        snprintf(virb, sizeof(virb), "%s/sigs_%d_VIRB", dir, n);
+        snprintf(suspect, sizeof(suspect), "%s/suspect_%d", dir, n);
+        if (write_corpus(n, virl, virb, suspect) != 0) {
+            fprintf(stderr, "Failed to write the corpus under %s\n", dir);
+            return;
+        }
+
+        suite_run("load", "VIRL", n, virl, NULL);
+        suite_run("load", "VIRB", n, virb, NULL);
+        suite_run("detect", "VIRL", n, virl, suspect);
+        suite_run("scan", "VIRL", n, virl, suspect);
+        suite_run("neutralize", "VIRL", n, virl, suspect);
+    }
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+    if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+        bench_suite(argc > 2 ? argv[2] : "bench-data");
+        return 0;
+    }
+    if (argc < 2 || strcmp(argv[1], "engines") == 0) bench_engines();
+    if (argc < 2 || strcmp(argv[1], "prefilter") == 0) bench_prefilter();
+    if (argc < 2 || strcmp(argv[1], "patterns") == 0) bench_patterns();
+    return 0;
+}
@@ -0,0 +1,260 @@
+// Times check_merge on generated ELF64 relocatables with 1k, 10k and 100k global
+// symbols per file against the old pairwise strcmp scan. The pairwise scan is
+// quadratic, so it only runs up to 10k symbols.
+//   ./bench merge [dir]
+// Resolves a million random addresses against generated objects with up to 1M
+// symbols by plain binary search, one Eytzinger search at a time and batched.
+//   ./bench addr2sym [dir]
+#define ELF_NO_MAIN
+#include "myELF.c"
+
+#include <time.h>
+
+#define NAIVE_LIMIT 10000
+#define MISSING_EVERY 100  // every 100th undefined symbol has no definition
+#define LOOKUPS 1000000
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes a relocatable with sections NULL, .text, .symtab, .strtab, .shstrtab.
+// The first file defines even-numbered symbols and references odd-numbered
+// ones; the second defines the odd ones (minus a few) plus a few of the even.
+int write_object(const char* path, int nsyms, int second) {
+    static const char shstr[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+    size_t str_cap = (size_t)nsyms * 24 + 1;
+    char *str = malloc(str_cap);
+    Elf64_Sym *syms = calloc(nsyms + 1, sizeof(Elf64_Sym));
+    size_t str_len = 1;
+    str[0] = '\0';
+
+    for (int i = 0; i < nsyms; i++) {
+        Elf64_Sym *sym = &syms[i + 1];
+        int defined = second ? (i % 2 == 1 && i % (2 * MISSING_EVERY) != 1) || i % 1000 == 0 : i % 2 == 0;
+        sym->st_name = str_len;
+        str_len += sprintf(str + str_len, "bench_symbol_%d", i) + 1;
+        sym->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        sym->st_shndx = defined ? 1 : SHN_UNDEF;
+        sym->st_value = defined ? i * 16 : 0;
+        sym->st_size = defined ? 8 : 0;
+    }
+
+    Elf64_Ehdr hdr = {0};
+    memcpy(hdr.e_ident, ELFMAG, SELFMAG);
+    hdr.e_ident[EI_CLASS] = ELFCLASS64;
+    hdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    hdr.e_ident[EI_VERSION] = EV_CURRENT;
+    hdr.e_type = ET_REL;
+    hdr.e_machine = EM_X86_64;
+    hdr.e_version = EV_CURRENT;
+    hdr.e_ehsize = sizeof(Elf64_Ehdr);
+    hdr.e_shentsize = sizeof(Elf64_Shdr);
+    hdr.e_shnum = 5;
+    hdr.e_shstrndx = 4;
+
+    Elf64_Shdr sh[5] = {{0}};
+    size_t off = sizeof(Elf64_Ehdr);
+    sh[1] = (Elf64_Shdr){1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 0, off, 16, 0, 0, 16, 0};
+    off += 16;
+    sh[2] = (Elf64_Shdr){7, SHT_SYMTAB, 0, 0, off, (nsyms + 1) * sizeof(Elf64_Sym), 3, 1, 8, sizeof(Elf64_Sym)};
+    off += sh[2].sh_size;
+    sh[3] = (Elf64_Shdr){15, SHT_STRTAB, 0, 0, off, str_len, 0, 0, 1, 0};
+    off += str_len;
+    sh[4] = (Elf64_Shdr){23, SHT_STRTAB, 0, 0, off, sizeof(shstr), 0, 0, 1, 0};
+    off += sizeof(shstr);
+    off = (off + 7) & ~7UL;
+    hdr.e_shoff = off;
+
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        perror(path);
+        free(str);
+        free(syms);
+        return -1;
+    }
+    static const unsigned char text[16] = {0xc3};
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(text, sizeof(text), 1, out);
+    fwrite(syms, sizeof(Elf64_Sym), nsyms + 1, out);
+    fwrite(str, 1, str_len, out);
+    fwrite(shstr, 1, sizeof(shstr), out);
+    while (ftell(out) < off) fputc(0, out);
+    fwrite(sh, sizeof(sh), 1, out);
+    fclose(out);
+    free(str);
+    free(syms);
+    return 0;
+}
+
+int open_object(ElfFile* f, const char* path) {
+    char err[512];
+    if (open_elf(f, path, err, sizeof(err)) != 0) {
+        fprintf(stderr, "%s: %s\n", path, err);
+        return -1;
+    }
+    return 0;
+}
+
+// The check_merge loop before the hash table: every global of the first file
+// against every symbol of the second. Returns the number of reports.
+int naive_check(ElfFile* f1, ElfFile* f2) {
+    Elf64_Sym *syms[2];
+    const char *strs[2];
+    int counts[2];
+    ElfFile *f[2] = {f1, f2};
+    for (int k = 0; k < 2; k++) {
+        Elf64_Ehdr *hdr = f[k]->map;
+        Elf64_Shdr *sh = (Elf64_Shdr *)(f[k]->map + hdr->e_shoff);
+        syms[k] = (Elf64_Sym *)(f[k]->map + sh[2].sh_offset);
+        strs[k] = f[k]->map + sh[3].sh_offset;
+        counts[k] = sh[2].sh_size / sizeof(Elf64_Sym);
+    }
+
+    int reports = 0;
+    for (int i = 1; i < counts[0]; i++) {
+        const char *name1 = strs[0] + syms[0][i].st_name;
+        int defined = 0;
+        for (int j = 1; j < counts[1]; j++) {
+            if (syms[1][j].st_shndx != SHN_UNDEF && strcmp(name1, strs[1] + syms[1][j].st_name) == 0) {
+                defined = 1;
+                break;
+            }
+        }
+        if ((syms[0][i].st_shndx == SHN_UNDEF) != defined) reports++;
+    }
+    return reports;
+}
+
+// Runs check_merge with stdout sent to /dev/null and counts the reports it wrote
+int hash_check(ElfFile* f1, ElfFile* f2, double* seconds) {
+    char path[] = "/tmp/myelf-bench-XXXXXX";
+    int tmp = mkstemp(path);
+    int saved = dup(STDOUT_FILENO);
+    fflush(stdout);
+    dup2(tmp, STDOUT_FILENO);
+    double t = now_sec();
+    check_merge64(f1, f2);
+    fflush(stdout);
+    *seconds = now_sec() - t;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    int reports = 0;
+    char c;
+    lseek(tmp, 0, SEEK_SET);
+    FILE *in = fdopen(tmp, "r");
+    while ((c = fgetc(in)) != EOF) reports += c == '\n';
+    fclose(in);
+    unlink(path);
+    return reports;
+}
+
+// Plain binary search over the sorted intervals, for comparison
+const sym_interval* binary_find(const addr_map* m, unsigned long long addr) {
+    unsigned int lo = 0, hi = m->count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (m->intervals[mid].start <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 && addr < m->intervals[lo - 1].end ? &m->intervals[lo - 1] : NULL;
+}
+
+int bench_addr2sym(const char* dir) {
+    int counts[] = {1000, 100000, 1000000};
+    unsigned long long *addrs = malloc(LOOKUPS * sizeof(unsigned long long));
+    const sym_interval **results[2] = {
+        malloc(LOOKUPS * sizeof(sym_interval*)), malloc(LOOKUPS * sizeof(sym_interval*)),
+    };
+
+    printf("%-10s %-10s %10s %12s %10s\n", "symbols", "search", "found", "seconds", "ns/lookup");
+    for (int k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+        int n = counts[k];
+        char path[512];
+        snprintf(path, sizeof(path), "%s/bench-%d-addr.o", dir, n);
+        ElfFile f;
+        addr_map m;
+        if (write_object(path, n, 0) != 0 || open_object(&f, path) != 0) return 1;
+        double t = now_sec();
+        if (addr_map_build(&m, &f) != 0) return 1;
+        t = now_sec() - t;
+        printf("%-10d %-10s %10u %12.4f\n", n, "build", m.count, t);
+
+        // Defined 8-byte symbols start every 32 bytes, so a quarter of the
+        // lookups hit one
+        for (int i = 0; i < LOOKUPS; i++) addrs[i] = ((unsigned long long)rand() * RAND_MAX + rand()) % (n * 16ULL);
+        const char *names[] = {"binary", "eytzinger", "batched"};
+        for (int s = 0; s < 3; s++) {
+            t = now_sec();
+            if (s == 2) {
+                addr_map_find_many(&m, addrs, LOOKUPS, results[1]);
+            } else {
+                for (int i = 0; i < LOOKUPS; i++) {
+                    results[s][i] = s == 0 ? binary_find(&m, addrs[i]) : addr_map_find(&m, addrs[i]);
+                }
+            }
+            t = now_sec() - t;
+            int found = 0, mismatched = 0;
+            for (int i = 0; i < LOOKUPS; i++) {
+                found += results[s ? 1 : 0][i] != NULL;
+                mismatched += results[s ? 1 : 0][i] != results[0][i];
+            }
+            printf("%-10d %-10s %10d %12.4f %10.1f\n", n, names[s], found, t, t * 1e9 / LOOKUPS);
+            if (mismatched) printf("%d results differ from binary search\n", mismatched);
+        }
+        addr_map_free(&m);
+        close_elf(&f);
+        unlink(path);
+    }
+    free(addrs);
+    free(results[0]);
+    free(results[1]);
+    return 0;
+}
+
+int bench_merge(const char* dir) {
+    int counts[] = {1000, 10000, 100000};
+
+    printf("%-10s %-8s %10s %12s\n", "symbols", "method", "reports", "seconds");
+    for (int k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+        int n = counts[k];
+        char path1[512], path2[512];
+        snprintf(path1, sizeof(path1), "%s/bench-%d-a.o", dir, n);
+        snprintf(path2, sizeof(path2), "%s/bench-%d-b.o", dir, n);
+        ElfFile f1, f2;
+        if (write_object(path1, n, 0) != 0 || write_object(path2, n, 1) != 0) return 1;
+        if (open_object(&f1, path1) != 0 || open_object(&f2, path2) != 0) return 1;
+
+        double t;
+        int reports = hash_check(&f1, &f2, &t);
+        printf("%-10d %-8s %10d %12.4f\n", n, "hash", reports, t);
+
+        if (n <= NAIVE_LIMIT) {
+            t = now_sec();
+            reports = naive_check(&f1, &f2);
+            t = now_sec() - t;
+            printf("%-10d %-8s %10d %12.4f\n", n, "pairwise", reports, t);
+        }
+
+        close_elf(&f1);
+        close_elf(&f2);
+        unlink(path1);
+        unlink(path2);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *mode = argc > 1 ? argv[1] : "merge";
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    if (strcmp(mode, "merge") == 0) return bench_merge(dir);
+    if (strcmp(mode, "addr2sym") == 0) return bench_addr2sym(dir);
+    fprintf(stderr, "Usage: %s [merge|addr2sym] [dir]\n", argv[0]);
+    return 2;
+}
@@ -5,21 +5,50 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
 #include <elf.h>
 
+#define WRITER_BUFFER_SIZE (64 * 1024)  // batch output is flushed in blocks of this size
+#define FIND_LANES 8                    // addresses resolved side by side by addr_map_find_many
+#define INDEX_VERSION 1                 // bumped whenever the layout of a symbol index changes
+
+typedef struct {
+    int fd;
+    int cls;            // ELFCLASS32 or ELFCLASS64, picks the specialized functions
+    void *map;
+    size_t size;
+    char name[256];
+    // Views into the mapping, checked and cached once by open_elf: every
+    // section lies inside the file, the string tables end in a NUL and every
+    // section and symbol name offset points inside its table
+    void *sections;         // section header table, shnum entries
+    size_t shnum;
+    size_t shstrndx;        // 0 when the file has no section names
+    const char *shstrtab;
+    size_t shstrtab_size;
+    void *symtab;           // first .symtab, NULL if the file has none
+    size_t symtab_idx;
+    int num_symtabs;
+    size_t num_syms;
+    const char *strtab;
+    size_t strtab_size;
+    void *dynsym;           // first .dynsym, NULL if the file has none
+    size_t num_dynsyms;
+    const char *dynstr;
+    size_t dynstr_size;
+} ElfFile;
+
 typedef struct {
     int dbg;
-    int fd1;
-    int fd2;
-    void *map1;
-    void *map2;
-    size_t size1;
-    size_t size2;
-    char name1[256];
-    char name2[256];
+    ElfFile *files;
+    int num_files;
+    int cap_files;
 } ElfState;
 
-ElfState state = {0, -1, -1, NULL, NULL, 0, 0};
+ElfState state = {0, NULL, 0, 0};
 
 struct MenuOption {
     char *name;
@@ -81,350 +110,2141 @@ const char* get_section_type(uint32_t type) {
     return "UNKNOWN";
 }
 
-void examine_elf(ElfState* s) {
-    if (s->fd1 != -1 && s->fd2 != -1) {
-        printf("Two ELF files are already open. Cannot open more files.\n");
-        return;
+// Open-addressing set of symbol names. Names are not copied: the slots point
+// straight into the mapped string table, so building it costs one hash per symbol.
+// A slot can also carry a value, e.g. the output index a merged name resolved to.
+typedef struct {
+    const char *name;
+    uint32_t hash;
+    int value;
+} sym_slot;
+
+typedef struct {
+    sym_slot *slots;
+    uint32_t mask;
+    uint32_t count;
+} sym_table;
+
+// FNV-1a over the NUL-terminated name
+uint32_t sym_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+int sym_table_init(sym_table* t, int expected) {
+    uint32_t cap = 16;
+    while (cap < (uint32_t)expected * 2) cap <<= 1;  // keep the load factor under 1/2
+    t->slots = calloc(cap, sizeof(sym_slot));
+    t->mask = cap - 1;
+    t->count = 0;
+    return t->slots ? 0 : -1;
+}
+
+sym_slot* sym_table_find(sym_table* t, const char* name, uint32_t hash) {
+    uint32_t i = hash & t->mask;
+    while (t->slots[i].name) {
+        if (t->slots[i].hash == hash && strcmp(t->slots[i].name, name) == 0) break;
+        i = (i + 1) & t->mask;
     }
+    return &t->slots[i];
+}
 
-    printf("Enter ELF file name: ");
-    char fname[256];
-    fgets(fname, sizeof(fname), stdin);
-    fname[strcspn(fname, "\n")] = '\0';
+// Slot holding name, claimed for it if the name is new; a new slot has value -1
+sym_slot* sym_table_get(sym_table* t, const char* name) {
+    uint32_t hash = sym_hash(name);
+    sym_slot *slot = sym_table_find(t, name, hash);
+    if (!slot->name) {
+        slot->name = name;
+        slot->hash = hash;
+        slot->value = -1;
+        t->count++;
+    }
+    return slot;
+}
+
+void sym_table_insert(sym_table* t, const char* name) {
+    sym_table_get(t, name);
+}
+
+int sym_table_contains(sym_table* t, const char* name) {
+    return sym_table_find(t, name, sym_hash(name))->name != NULL;
+}
+
+void sym_table_free(sym_table* t) {
+    free(t->slots);
+    t->slots = NULL;
+}
+
+// One piece of a planned output file: len bytes from src land at offset
+typedef struct {
+    size_t offset;
+    const void *src;
+    size_t len;
+} out_piece;
+
+// Sizes the output once, maps it and copies every piece into place; gaps stay zero
+int write_layout(int outfd, out_piece* pieces, int count, size_t total) {
+    if (ftruncate(outfd, total) != 0) {
+        perror("Failed to size output file");
+        return -1;
+    }
+    char *out = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0);
+    if (out == MAP_FAILED) {
+        perror("Failed to map output file");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(out + pieces[i].offset, pieces[i].src, pieces[i].len);
+    }
+    munmap(out, total);
+    return 0;
+}
+
+// Growable string table; every string is stored with its terminating NUL
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} str_buf;
+
+// Appends prefix followed by str and returns the offset of the combined string
+size_t str_buf_add(str_buf* b, const char* prefix, const char* str) {
+    size_t plen = strlen(prefix), slen = strlen(str);
+    if (b->len + plen + slen + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + plen + slen + 1) cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (!data) {
+            printf("Error: Out of memory\n");
+            exit(1);
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    size_t offset = b->len;
+    memcpy(b->data + b->len, prefix, plen);
+    memcpy(b->data + b->len + plen, str, slen + 1);
+    b->len += plen + slen + 1;
+    return offset;
+}
+
+// Buffered output for the batch CLI, as text or as JSON lines. Numbers and strings
+// are formatted by hand so a large listing costs no per-field stdio calls.
+// A writer without a file collects everything in mem instead, which is how
+// parallel workers keep their output until it is stitched together in order.
+typedef struct out_writer {
+    FILE* file;
+    int json;
+    size_t len;
+    char *mem;
+    size_t mem_len;
+    size_t mem_cap;
+    char buf[WRITER_BUFFER_SIZE];
+} out_writer;
+
+void writer_init(out_writer* w, FILE* file, int json) {
+    w->file = file;
+    w->json = json;
+    w->len = 0;
+    w->mem = NULL;
+    w->mem_len = 0;
+    w->mem_cap = 0;
+}
+
+// Moves the buffered bytes out, to the file or to the end of mem
+void writer_spill(out_writer* w) {
+    if (w->len == 0) return;
+    if (w->file) {
+        fwrite(w->buf, 1, w->len, w->file);
+    } else {
+        if (w->mem_len + w->len > w->mem_cap) {
+            size_t cap = w->mem_cap ? w->mem_cap * 2 : 4 * WRITER_BUFFER_SIZE;
+            while (cap < w->mem_len + w->len) cap *= 2;
+            char *mem = realloc(w->mem, cap);
+            if (!mem) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(1);
+            }
+            w->mem = mem;
+            w->mem_cap = cap;
+        }
+        memcpy(w->mem + w->mem_len, w->buf, w->len);
+        w->mem_len += w->len;
+    }
+    w->len = 0;
+}
+
+void writer_flush(out_writer* w) {
+    writer_spill(w);
+    if (w->file) fflush(w->file);
+}
+
+// Number of bytes written so far
+size_t writer_pos(out_writer* w) {
+    return w->mem_len + w->len;
+}
+
+void writer_bytes(out_writer* w, const char* data, size_t len) {
+    while (len > 0) {
+        if (w->len == WRITER_BUFFER_SIZE) writer_spill(w);
+        size_t n = WRITER_BUFFER_SIZE - w->len;
+        if (n > len) n = len;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void writer_str(out_writer* w, const char* str) {
+    writer_bytes(w, str, strlen(str));
+}
+
+// str left-aligned and padded with spaces to width
+void writer_padded(out_writer* w, const char* str, size_t width) {
+    static const char spaces[] = "                                ";
+    size_t len = strlen(str);
+    writer_bytes(w, str, len);
+    while (len < width) {
+        size_t n = width - len < sizeof(spaces) - 1 ? width - len : sizeof(spaces) - 1;
+        writer_bytes(w, spaces, n);
+        len += n;
+    }
+}
+
+void writer_ulong(out_writer* w, unsigned long long value) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    writer_bytes(w, digits + i, sizeof(digits) - i);
+}
+
+// Right-aligned in width columns, like %*d
+void writer_ulong_width(out_writer* w, unsigned long long value, int width) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while ((int)sizeof(digits) - i < width && i > 0) digits[--i] = ' ';
+    writer_bytes(w, digits + i, sizeof(digits) - i);
+}
+
+// "0x" and at least min_digits lowercase hex digits, like 0x%0*llx
+void writer_hex(out_writer* w, unsigned long long value, int min_digits) {
+    static const char hex[] = "0123456789abcdef";
+    char digits[20];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = hex[value & 15];
+        value >>= 4;
+    } while (value > 0);
+    while ((int)sizeof(digits) - i < min_digits && i > 2) digits[--i] = '0';
+    digits[--i] = 'x';
+    digits[--i] = '0';
+    writer_bytes(w, digits + i, sizeof(digits) - i);
+}
+
+void writer_json_str(out_writer* w, const char* str) {
+    static const char hex[] = "0123456789abcdef";
+    writer_bytes(w, "\"", 1);
+    for (size_t i = 0; str[i] != '\0'; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            char esc[2] = {'\\', c};
+            writer_bytes(w, esc, 2);
+        } else if (c < 0x20) {
+            char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            writer_bytes(w, esc, 6);
+        } else {
+            writer_bytes(w, (const char*)&c, 1);
+        }
+    }
+    writer_bytes(w, "\"", 1);
+}
+
+// Symbol index ("ELFX"): the symbols of a set of ELF files, written by 'myELF index'
+// and queried through a read-only mapping. The header is followed by the file table,
+// the symbol table, two permutations of it and the string blob, each at an 8-byte
+// aligned offset. A file's symbols are contiguous and keep their symbol table order.
+typedef struct index_header {
+    char magic[4];
+    unsigned int version;
+    unsigned int num_files;
+    unsigned int num_symbols;
+    unsigned int num_by_addr;
+    unsigned int reserved;
+    unsigned long long files_offset;    // index_file[num_files]
+    unsigned long long symbols_offset;  // index_symbol[num_symbols]
+    unsigned long long by_name_offset;  // symbol numbers sorted by name, then file
+    unsigned long long by_addr_offset;  // defined symbols sorted by file, then address
+    unsigned long long strings_offset;
+    unsigned long long strings_size;
+} index_header;
+
+typedef struct index_file {
+    unsigned long long path;  // offsets into the string blob
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned int first_symbol;
+    unsigned int num_symbols;
+    unsigned int first_addr;  // this file's run in by_addr
+    unsigned int num_addr;
+} index_file;
+
+typedef struct index_symbol {
+    unsigned long long value;
+    unsigned long long size;
+    unsigned long long name;
+    unsigned long long section;  // name of the defining section, "" if none
+    unsigned int file;
+    unsigned short shndx;
+    unsigned char info;
+    unsigned char other;
+} index_symbol;
+
+_Static_assert(sizeof(index_file) == 48, "index_file layout changed");
+_Static_assert(sizeof(index_symbol) == 40, "index_symbol layout changed");
 
-    int fd = open(fname, O_RDONLY);
+// An index being assembled in memory
+typedef struct index_builder {
+    index_file *files;
+    unsigned int num_files;
+    unsigned int cap_files;
+    index_symbol *symbols;
+    unsigned int num_symbols;
+    unsigned int cap_symbols;
+    str_buf strings;
+} index_builder;
+
+// Room for n more symbols; -1 if it cannot be had
+int index_reserve(index_builder* b, size_t n) {
+    if (b->num_symbols + n <= b->cap_symbols) return 0;
+    size_t cap = b->cap_symbols ? b->cap_symbols : 1024;
+    while (cap < b->num_symbols + n) cap *= 2;
+    if (cap > 0xFFFFFFFFu) return -1;
+    index_symbol *symbols = realloc(b->symbols, cap * sizeof(index_symbol));
+    if (!symbols) return -1;
+    b->symbols = symbols;
+    b->cap_symbols = cap;
+    return 0;
+}
+
+// addr2sym: one symbol as the address range it covers. Names point into the mapped file.
+typedef struct sym_interval {
+    unsigned long long start;
+    unsigned long long end;  // exclusive
+    const char *name;
+    const char *section;
+    unsigned int rank;       // among intervals starting together the lowest rank is kept
+} sym_interval;
+
+// Intervals sorted by start, plus their starts again in Eytzinger (breadth-first)
+// order: eyt[1] is the median, the children of k are 2k and 2k+1. A search then
+// walks memory front to back and the top levels share a few cache lines.
+typedef struct addr_map {
+    sym_interval *intervals;
+    unsigned int count;
+    unsigned long long *eyt;  // eyt[1..count]
+    unsigned int *eyt_pos;    // index in intervals of eyt[k]
+    int depth;                // levels of the tree
+} addr_map;
+
+// Where one input file's sections and symbols went in a merge
+typedef struct {
+    int *sec_map;       // input section -> output section, 0 if dropped
+    size_t *sec_off;    // input section -> offset inside its output section
+    char *group_state;  // GROUP_KEPT or GROUP_DISCARDED for COMDAT group members
+    int *sym_map;       // input symbol -> output symbol, 0 if dropped
+} merge_input;
+
+#define GROUP_KEPT 1
+#define GROUP_DISCARDED 2
+
+// Whether len bytes at off lie inside the mapping of f
+int in_file(ElfFile* f, unsigned long long off, unsigned long long len) {
+    return off <= f->size && len <= f->size - off;
+}
+
+// Whether a section can be used as a string table: mapped and NUL-terminated
+int string_table(ElfFile* f, uint32_t type, unsigned long long off, unsigned long long len) {
+    return type == SHT_STRTAB && len > 0 && in_file(f, off, len) && ((char *)f->map)[off + len - 1] == '\0';
+}
+
+// Everything that walks ELF structures is written once here and expanded for
+// both classes, so Elf32 and Elf64 files each get a specialized copy with
+// native field widths instead of a per-field class check. Wide fields are
+// printed through unsigned long long so one format string serves both.
+#define ELF_CLASS_FUNCS(N) \
+\
+void print_header##N(ElfFile* f) { \
+    Elf##N##_Ehdr *hdr = (Elf##N##_Ehdr *)f->map; \
+    printf("Entry point: 0x%llx\n", (unsigned long long)hdr->e_entry); \
+    printf("Section header offset: %llu\n", (unsigned long long)hdr->e_shoff); \
+    printf("Number of section headers: %d\n", hdr->e_shnum); \
+    printf("Size of section header: %d\n", hdr->e_shentsize); \
+    printf("Program header offset: %llu\n", (unsigned long long)hdr->e_phoff); \
+    printf("Number of program headers: %d\n", hdr->e_phnum); \
+    printf("Size of program header: %d\n", hdr->e_phentsize); \
+} \
+\
+/* Checks the section header table, every section body, the section name */ \
+/* table and the symbol tables against the mapping once, and caches where */ \
+/* they are. Everything after open_elf indexes them without further checks. */ \
+int parse_elf##N(ElfFile* f, char* err, size_t errlen) { \
+    Elf##N##_Ehdr *hdr = (Elf##N##_Ehdr *)f->map; \
+    Elf##N##_Shdr *sections = NULL; \
+    size_t shnum = 0, shstrndx = SHN_UNDEF; \
+    if (hdr->e_shoff != 0) { \
+        if (hdr->e_shentsize != sizeof(Elf##N##_Shdr) || !in_file(f, hdr->e_shoff, sizeof(Elf##N##_Shdr))) { \
+            snprintf(err, errlen, "Corrupt section header table"); \
+            return -1; \
+        } \
+        sections = (Elf##N##_Shdr *)(f->map + hdr->e_shoff); \
+        /* Files with too many sections keep the real counts in section 0 */ \
+        shnum = hdr->e_shnum ? hdr->e_shnum : sections[0].sh_size; \
+        shstrndx = hdr->e_shstrndx == SHN_XINDEX ? sections[0].sh_link : hdr->e_shstrndx; \
+        if (shnum > (f->size - hdr->e_shoff) / sizeof(Elf##N##_Shdr)) { \
+            snprintf(err, errlen, "Corrupt section header table"); \
+            return -1; \
+        } \
+    } \
+    f->sections = sections; \
+    f->shnum = shnum; \
+    f->shstrndx = 0; \
+    f->shstrtab = NULL; \
+    f->shstrtab_size = 0; \
+    f->symtab = f->dynsym = NULL; \
+    f->symtab_idx = 0; \
+    f->num_symtabs = 0; \
+    f->num_syms = f->num_dynsyms = 0; \
+    f->strtab = f->dynstr = NULL; \
+    f->strtab_size = f->dynstr_size = 0; \
+\
+    for (size_t i = 0; i < shnum; i++) { \
+        Elf##N##_Shdr *sec = &sections[i]; \
+        if (sec->sh_type != SHT_NULL && sec->sh_type != SHT_NOBITS && !in_file(f, sec->sh_offset, sec->sh_size)) { \
+            snprintf(err, errlen, "Section %zu extends past the end of the file", i); \
+            return -1; \
+        } \
+    } \
+\
+    if (shstrndx != SHN_UNDEF) { \
+        if (shstrndx >= shnum || !string_table(f, sections[shstrndx].sh_type, sections[shstrndx].sh_offset, \
+            sections[shstrndx].sh_size)) { \
+            snprintf(err, errlen, "Corrupt section name table"); \
+            return -1; \
+        } \
+        f->shstrndx = shstrndx; \
+        f->shstrtab = (const char *)(f->map + sections[shstrndx].sh_offset); \
+        f->shstrtab_size = sections[shstrndx].sh_size; \
+        for (size_t i = 0; i < shnum; i++) { \
+            if (sections[i].sh_name >= f->shstrtab_size) { \
+                snprintf(err, errlen, "Section %zu has a corrupt name", i); \
+                return -1; \
+            } \
+        } \
+    } \
+\
+    for (size_t i = 0; i < shnum; i++) { \
+        Elf##N##_Shdr *sec = &sections[i]; \
+        if (sec->sh_type != SHT_SYMTAB && sec->sh_type != SHT_DYNSYM) continue; \
+        Elf##N##_Shdr *str = sec->sh_link < shnum ? &sections[sec->sh_link] : NULL; \
+        if (sec->sh_size % sizeof(Elf##N##_Sym) != 0 || !str || \
+            !string_table(f, str->sh_type, str->sh_offset, str->sh_size)) { \
+            snprintf(err, errlen, "Symbol table %zu is corrupt", i); \
+            return -1; \
+        } \
+        Elf##N##_Sym *syms = (Elf##N##_Sym *)(f->map + sec->sh_offset); \
+        size_t count = sec->sh_size / sizeof(Elf##N##_Sym); \
+        for (size_t j = 0; j < count; j++) { \
+            if (syms[j].st_name >= str->sh_size) { \
+                snprintf(err, errlen, "Symbol %zu of section %zu has a corrupt name", j, i); \
+                return -1; \
+            } \
+        } \
+        if (sec->sh_type == SHT_SYMTAB && f->num_symtabs++ == 0) { \
+            f->symtab = syms; \
+            f->symtab_idx = i; \
+            f->num_syms = count; \
+            f->strtab = (const char *)(f->map + str->sh_offset); \
+            f->strtab_size = str->sh_size; \
+        } else if (sec->sh_type == SHT_DYNSYM && !f->dynsym) { \
+            f->dynsym = syms; \
+            f->num_dynsyms = count; \
+            f->dynstr = (const char *)(f->map + str->sh_offset); \
+            f->dynstr_size = str->sh_size; \
+        } \
+    } \
+    return 0; \
+} \
+\
+/* Name of section idx, or "Unavailable" for indexes outside the table */ \
+const char* get_section_name##N(ElfFile* f, size_t idx) { \
+    if (idx >= f->shnum) return "Unavailable"; \
+    return f->shstrtab ? f->shstrtab + ((Elf##N##_Shdr *)f->sections)[idx].sh_name : ""; \
+} \
+\
+void print_sections##N(ElfState* s, ElfFile* f) { \
+    Elf##N##_Shdr *sections = f->sections; \
+\
+    printf("\nFile: %s\n", f->name); \
+\
+    if (s->dbg) { \
+        Elf##N##_Ehdr *hdr = (Elf##N##_Ehdr *)f->map; \
+        printf("Debug: ELF header details:\n"); \
+        printf("  e_shoff: %llx\n", (unsigned long long)hdr->e_shoff); \
+        printf("  e_shnum: %zu\n", f->shnum); \
+        printf("  e_shstrndx: %zu\n", f->shstrndx); \
+        printf("Debug: shstrtab details:\n"); \
+        printf("  shstrtab_offset: %llx\n", f->shstrtab ? (unsigned long long)((void *)f->shstrtab - f->map) : 0ULL); \
+        printf("  shstrtab_size: %llx\n", (unsigned long long)f->shstrtab_size); \
+    } \
+\
+    printf("[index] section_name             section_address section_offset section_size section_type\n"); \
+\
+    for (size_t j = 0; j < f->shnum; j++) { \
+        printf("[%2zu] %-24s 0x%08llx      0x%06llx         0x%06llx       %s\n", \
+            j, \
+            get_section_name##N(f, j), \
+            (unsigned long long)sections[j].sh_addr, \
+            (unsigned long long)sections[j].sh_offset, \
+            (unsigned long long)sections[j].sh_size, \
+            get_section_type(sections[j].sh_type)); \
+    } \
+} \
+\
+void print_symbols##N(ElfState* s, ElfFile* f) { \
+    if (!f->symtab) { \
+        printf("No symbol table found in ELF file.\n"); \
+        return; \
+    } \
+\
+    Elf##N##_Sym *syms = f->symtab; \
+\
+    if (s->dbg) { \
+        printf("Debug: Symbol table size: %llu\n", (unsigned long long)(f->num_syms * sizeof(Elf##N##_Sym))); \
+        printf("Debug: Number of symbols: %zu\n", f->num_syms); \
+    } \
+\
+    printf("\nFile: %s\n", f->name); \
+    printf("[index] value section_index section_name symbol_name\n"); \
+\
+    for (size_t j = 0; j < f->num_syms; j++) { \
+        printf("[%2zu] 0x%08llx %d %s %s\n", \
+            j, \
+            (unsigned long long)syms[j].st_value, \
+            syms[j].st_shndx, \
+            get_section_name##N(f, syms[j].st_shndx), \
+            f->strtab + syms[j].st_name); \
+    } \
+} \
+\
+/* Batch listings: the same rows as print_sections/print_symbols, or a JSON */ \
+/* array, written through the buffered writer */ \
+void write_sections##N(out_writer* w, ElfFile* f) { \
+    Elf##N##_Shdr *sections = f->sections; \
+\
+    if (w->json) { \
+        writer_str(w, ",\"sections\":["); \
+    } else { \
+        writer_str(w, "[index] section_name             section_address section_offset section_size section_type\n"); \
+    } \
+    for (size_t j = 0; j < f->shnum; j++) { \
+        Elf##N##_Shdr *sec = &sections[j]; \
+        if (w->json) { \
+            writer_str(w, j ? ",{\"index\":" : "{\"index\":"); \
+            writer_ulong(w, j); \
+            writer_str(w, ",\"name\":"); \
+            writer_json_str(w, get_section_name##N(f, j)); \
+            writer_str(w, ",\"type\":\""); \
+            writer_str(w, get_section_type(sec->sh_type)); \
+            writer_str(w, "\",\"address\":"); \
+            writer_ulong(w, sec->sh_addr); \
+            writer_str(w, ",\"offset\":"); \
+            writer_ulong(w, sec->sh_offset); \
+            writer_str(w, ",\"size\":"); \
+            writer_ulong(w, sec->sh_size); \
+            writer_str(w, "}"); \
+        } else { \
+            writer_str(w, "["); \
+            writer_ulong_width(w, j, 2); \
+            writer_str(w, "] "); \
+            writer_padded(w, get_section_name##N(f, j), 24); \
+            writer_str(w, " "); \
+            writer_hex(w, sec->sh_addr, 8); \
+            writer_str(w, "      "); \
+            writer_hex(w, sec->sh_offset, 6); \
+            writer_str(w, "         "); \
+            writer_hex(w, sec->sh_size, 6); \
+            writer_str(w, "       "); \
+            writer_str(w, get_section_type(sec->sh_type)); \
+            writer_str(w, "\n"); \
+        } \
+    } \
+    if (w->json) writer_str(w, "]"); \
+} \
+\
+void write_symbols##N(out_writer* w, ElfFile* f) { \
+    if (w->json) { \
+        writer_str(w, ",\"symbols\":["); \
+    } else if (f->symtab) { \
+        writer_str(w, "[index] value section_index section_name symbol_name\n"); \
+    } else { \
+        writer_str(w, "No symbol table found in ELF file.\n"); \
+    } \
+    Elf##N##_Sym *syms = f->symtab; \
+    for (size_t j = 0; j < f->num_syms; j++) { \
+        Elf##N##_Sym *sym = &syms[j]; \
+        if (w->json) { \
+            writer_str(w, j ? ",{\"index\":" : "{\"index\":"); \
+            writer_ulong(w, j); \
+            writer_str(w, ",\"name\":"); \
+            writer_json_str(w, f->strtab + sym->st_name); \
+            writer_str(w, ",\"value\":"); \
+            writer_ulong(w, sym->st_value); \
+            writer_str(w, ",\"size\":"); \
+            writer_ulong(w, sym->st_size); \
+            writer_str(w, ",\"section_index\":"); \
+            writer_ulong(w, sym->st_shndx); \
+            writer_str(w, ",\"section\":"); \
+            writer_json_str(w, get_section_name##N(f, sym->st_shndx)); \
+            writer_str(w, "}"); \
+        } else { \
+            writer_str(w, "["); \
+            writer_ulong_width(w, j, 2); \
+            writer_str(w, "] "); \
+            writer_hex(w, sym->st_value, 8); \
+            writer_str(w, " "); \
+            writer_ulong(w, sym->st_shndx); \
+            writer_str(w, " "); \
+            writer_str(w, get_section_name##N(f, sym->st_shndx)); \
+            writer_str(w, " "); \
+            writer_str(w, f->strtab + sym->st_name); \
+            writer_str(w, "\n"); \
+        } \
+    } \
+    if (w->json) writer_str(w, "]"); \
+} \
+\
+/* Adds the symbols of f to the index as file number file: .symtab, or */ \
+/* .dynsym for stripped shared objects */ \
+int index_symbols##N(index_builder* b, ElfFile* f, unsigned int file) { \
+    Elf##N##_Shdr *sections = f->sections; \
+    Elf##N##_Sym *syms = f->symtab ? f->symtab : f->dynsym; \
+    size_t count = f->symtab ? f->num_syms : f->num_dynsyms; \
+    const char *names = f->symtab ? f->strtab : f->dynstr; \
+    if (!syms) return 0; \
+\
+    /* One string per section name, shared by all symbols defined there */ \
+    unsigned long long *sec_strings = calloc(f->shnum + 1, sizeof(unsigned long long)); \
+    if (!sec_strings) return -1; \
+    for (size_t j = 0; f->shstrtab && j < f->shnum; j++) { \
+        if (f->shstrtab[sections[j].sh_name]) { \
+            sec_strings[j] = str_buf_add(&b->strings, "", f->shstrtab + sections[j].sh_name); \
+        } \
+    } \
+\
+    if (index_reserve(b, count) != 0) { \
+        free(sec_strings); \
+        return -1; \
+    } \
+    for (size_t j = 1; j < count; j++) { \
+        Elf##N##_Sym *sym = &syms[j]; \
+        if (sym->st_name == 0) continue; \
+        index_symbol *out = &b->symbols[b->num_symbols++]; \
+        out->value = sym->st_value; \
+        out->size = sym->st_size; \
+        out->name = str_buf_add(&b->strings, "", names + sym->st_name); \
+        out->section = sym->st_shndx < f->shnum ? sec_strings[sym->st_shndx] : 0; \
+        out->file = file; \
+        out->shndx = sym->st_shndx; \
+        out->info = sym->st_info; \
+        out->other = sym->st_other; \
+    } \
+    free(sec_strings); \
+    return 0; \
+} \
+\
+/* Appends the named code and data symbols of f's .symtab and .dynsym to */ \
+/* intervals, which must have room for every entry of both tables */ \
+unsigned int collect_intervals##N(ElfFile* f, sym_interval* intervals) { \
+    unsigned int count = 0; \
+    for (int t = 0; t < 2; t++) { \
+        Elf##N##_Sym *syms = t ? f->dynsym : f->symtab; \
+        size_t n = t ? f->num_dynsyms : f->num_syms; \
+        const char *names = t ? f->dynstr : f->strtab; \
+        for (size_t j = 1; j < n; j++) { \
+            Elf##N##_Sym *sym = &syms[j]; \
+            int type = ELF##N##_ST_TYPE(sym->st_info); \
+            if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE || sym->st_name == 0 || \
+                type == STT_SECTION || type == STT_FILE) continue; \
+            sym_interval *iv = &intervals[count++]; \
+            iv->start = sym->st_value; \
+            iv->end = sym->st_value + sym->st_size; \
+            iv->name = names + sym->st_name; \
+            iv->section = sym->st_shndx < f->shnum ? get_section_name##N(f, sym->st_shndx) : ""; \
+            /* Prefer sized symbols, then .symtab over .dynsym, then globals over weak over local */ \
+            int bind = ELF##N##_ST_BIND(sym->st_info); \
+            iv->rank = (sym->st_size == 0) * 8 + t * 4 + (bind == STB_GLOBAL ? 0 : bind == STB_WEAK ? 1 : 2); \
+        } \
+    } \
+    return count; \
+} \
+\
+void check_merge##N(ElfFile* f1, ElfFile* f2) { \
+    if (f1->num_symtabs > 1) { \
+        printf("Multiple symbol tables found in first file.\n"); \
+        return; \
+    } \
+    if (f2->num_symtabs > 1) { \
+        printf("Multiple symbol tables found in second file.\n"); \
+        return; \
+    } \
+    if (!f1->symtab || !f2->symtab) { \
+        printf("Symbol table missing in one or both files.\n"); \
+        return; \
+    } \
+\
+    Elf##N##_Sym *syms1 = f1->symtab; \
+    Elf##N##_Sym *syms2 = f2->symtab; \
+\
+    /* Every defined name in the second file, pointing into its mapped strtab */ \
+    sym_table defined; \
+    if (sym_table_init(&defined, f2->num_syms) != 0) { \
+        printf("Error: Out of memory\n"); \
+        return; \
+    } \
+    for (size_t j = 1; j < f2->num_syms; j++) { \
+        if (syms2[j].st_shndx != SHN_UNDEF) sym_table_insert(&defined, f2->strtab + syms2[j].st_name); \
+    } \
+\
+    for (size_t i = 1; i < f1->num_syms; i++) { \
+        const char *name1 = f1->strtab + syms1[i].st_name; \
+\
+        if (ELF##N##_ST_BIND(syms1[i].st_info) == STB_GLOBAL) { \
+            int found = sym_table_contains(&defined, name1); \
+            if (syms1[i].st_shndx == SHN_UNDEF) { \
+                /* Check undefined symbols */ \
+                if (!found) printf("Symbol %s undefined\n", name1); \
+            } else if (found) { \
+                /* Check multiply defined symbols */ \
+                printf("Symbol %s multiply defined\n", name1); \
+            } \
+        } \
+    } \
+    sym_table_free(&defined); \
+} \
+\
+/* Checks what merge_files relies on beyond what open_elf already validated, */ \
+/* so the merge itself can index the mapped file without further checks */ \
+int check_relocatable##N(ElfFile* f) { \
+    Elf##N##_Ehdr *hdr = (Elf##N##_Ehdr *)f->map; \
+    if (hdr->e_type != ET_REL) { \
+        printf("Error: %s is not a relocatable file\n", f->name); \
+        return -1; \
+    } \
+    if (f->shnum == 0 || !f->shstrtab) { \
+        printf("Error: %s has a corrupt section header table\n", f->name); \
+        return -1; \
+    } \
+    if (f->num_symtabs > 1) { \
+        printf("Error: Multiple symbol tables found in %s\n", f->name); \
+        return -1; \
+    } \
+    Elf##N##_Shdr *sections = f->sections; \
+    size_t symtab = f->symtab_idx; \
+    size_t nsyms = f->num_syms; \
+    if (symtab && sections[symtab].sh_entsize != sizeof(Elf##N##_Sym)) { \
+        printf("Error: %s has a corrupt symbol table\n", f->name); \
+        return -1; \
+    } \
+    Elf##N##_Sym *syms = f->symtab; \
+    for (size_t j = 0; j < nsyms; j++) { \
+        if ((syms[j].st_shndx >= f->shnum && syms[j].st_shndx < SHN_LORESERVE) || syms[j].st_shndx == SHN_XINDEX) { \
+            printf("Error: Symbol %zu of %s is corrupt\n", j, f->name); \
+            return -1; \
+        } \
+    } \
+\
+    for (size_t i = 0; i < f->shnum; i++) { \
+        Elf##N##_Shdr *sec = &sections[i]; \
+        if (sec->sh_type == SHT_REL || sec->sh_type == SHT_RELA) { \
+            size_t entsize = sec->sh_type == SHT_REL ? sizeof(Elf##N##_Rel) : sizeof(Elf##N##_Rela); \
+            if (!symtab || sec->sh_link != symtab || sec->sh_info == 0 || sec->sh_info >= f->shnum || \
+                sec->sh_entsize != entsize || sec->sh_size % entsize != 0) { \
+                printf("Error: Relocation section %zu of %s is corrupt\n", i, f->name); \
+                return -1; \
+            } \
+            for (size_t off = 0; off < sec->sh_size; off += entsize) { \
+                Elf##N##_Rel *rel = (Elf##N##_Rel *)(f->map + sec->sh_offset + off); \
+                if (ELF##N##_R_SYM(rel->r_info) >= nsyms) { \
+                    printf("Error: Relocation section %zu of %s is corrupt\n", i, f->name); \
+                    return -1; \
+                } \
+            } \
+        } else if (sec->sh_type == SHT_GROUP) { \
+            Elf32_Word *words = (Elf32_Word *)(f->map + sec->sh_offset); \
+            size_t count = sec->sh_size / sizeof(Elf32_Word); \
+            int bad = !symtab || sec->sh_link != symtab || sec->sh_info >= nsyms || count == 0 || \
+                sec->sh_size % sizeof(Elf32_Word) != 0; \
+            for (size_t k = 1; !bad && k < count; k++) bad = words[k] == 0 || words[k] >= f->shnum; \
+            if (bad) { \
+                printf("Error: Group section %zu of %s is corrupt\n", i, f->name); \
+                return -1; \
+            } \
+        } \
+    } \
+    return 0; \
+} \
+\
+/* Picks which of two same-named globals the merged symbol table keeps: */ \
+/* a definition beats a common symbol, which beats an undefined reference, */ \
+/* and a global definition beats a weak one */ \
+void resolve_symbol##N(Elf##N##_Sym* cur, Elf##N##_Sym* sym, const char* name) { \
+    int cur_def = cur->st_shndx != SHN_UNDEF && cur->st_shndx != SHN_COMMON; \
+    int sym_def = sym->st_shndx != SHN_UNDEF && sym->st_shndx != SHN_COMMON; \
+    int cur_weak = ELF##N##_ST_BIND(cur->st_info) == STB_WEAK; \
+    int sym_weak = ELF##N##_ST_BIND(sym->st_info) == STB_WEAK; \
+    Elf##N##_Word st_name = cur->st_name; \
+\
+    if (sym_def) { \
+        if (!cur_def || (cur_weak && !sym_weak)) { \
+            *cur = *sym; \
+        } else if (!cur_weak && !sym_weak) { \
+            printf("Symbol %s multiply defined\n", name); \
+        } \
+    } else if (sym->st_shndx == SHN_COMMON) { \
+        if (cur->st_shndx == SHN_UNDEF) { \
+            *cur = *sym; \
+        } else if (cur->st_shndx == SHN_COMMON) { \
+            if (sym->st_size > cur->st_size) cur->st_size = sym->st_size; \
+            if (sym->st_value > cur->st_value) cur->st_value = sym->st_value; \
+        } \
+    } else if (cur->st_shndx == SHN_UNDEF && cur_weak && !sym_weak) { \
+        /* A strong reference makes the still undefined symbol strong */ \
+        cur->st_info = ELF##N##_ST_INFO(STB_GLOBAL, ELF##N##_ST_TYPE(cur->st_info)); \
+    } \
+    cur->st_name = st_name; \
+} \
+\
+/* Combines any number of relocatable files the way a relocatable link */ \
+/* does. Same-named sections are concatenated at their alignment, COMDAT */ \
+/* groups are kept once per signature, locals are copied and globals are */ \
+/* resolved by name, and relocations are rebased and renumbered. Hash tables */ \
+/* keep every step linear in the total input size. */ \
+int merge_files##N(ElfFile* files, int count, int outfd) { \
+    size_t total_sh = 0, total_syms = 0, total_rel = 0, total_group = 0; \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Ehdr *hdr = (Elf##N##_Ehdr *)files[f].map; \
+        if (check_relocatable##N(&files[f]) != 0) return -1; \
+        if (hdr->e_machine != ((Elf##N##_Ehdr *)files[0].map)->e_machine) { \
+            printf("Error: %s is built for a different machine\n", files[f].name); \
+            return -1; \
+        } \
+        Elf##N##_Shdr *sections = files[f].sections; \
+        total_sh += files[f].shnum; \
+        total_syms += files[f].num_syms; \
+        for (size_t i = 0; i < files[f].shnum; i++) { \
+            if (sections[i].sh_type == SHT_REL || sections[i].sh_type == SHT_RELA) total_rel += sections[i].sh_size; \
+            if (sections[i].sh_type == SHT_GROUP) total_group += sections[i].sh_size; \
+        } \
+    } \
+\
+    /* Data and group sections map at most one-to-one, and each output section */ \
+    /* gets at most one REL and one RELA section; 4 more for NULL and the tables */ \
+    size_t cap = 2 * total_sh + 4; \
+    merge_input *inputs = calloc(count, sizeof(merge_input)); \
+    Elf##N##_Shdr *out = calloc(cap, sizeof(Elf##N##_Shdr)); \
+    int *rel_out = calloc(2 * cap, sizeof(int)); \
+    size_t *rel_fill = calloc(cap, sizeof(size_t)); \
+    Elf##N##_Sym *out_syms = calloc(total_syms + 1, sizeof(Elf##N##_Sym)); \
+    char *rel_data = malloc(total_rel + 1); \
+    Elf32_Word *group_data = malloc(total_group + 1); \
+    out_piece *pieces = malloc((total_sh + cap + 8) * sizeof(out_piece)); \
+    str_buf strtab = {0}, shstrtab = {0}; \
+    sym_table names = {0}, globals = {0}, signatures = {0}; \
+    int result = -1; \
+    if (!inputs || !out || !rel_out || !rel_fill || !out_syms || !rel_data || !group_data || !pieces || \
+        sym_table_init(&names, total_sh) != 0 || sym_table_init(&globals, total_syms) != 0 || \
+        sym_table_init(&signatures, total_sh) != 0) { \
+        printf("Error: Out of memory\n"); \
+        goto done; \
+    } \
+    for (int f = 0; f < count; f++) { \
+        inputs[f].sec_map = calloc(files[f].shnum, sizeof(int)); \
+        inputs[f].sec_off = calloc(files[f].shnum, sizeof(size_t)); \
+        inputs[f].group_state = calloc(files[f].shnum, 1); \
+        inputs[f].sym_map = calloc(files[f].num_syms + 1, sizeof(int)); \
+        if (!inputs[f].sec_map || !inputs[f].sec_off || !inputs[f].group_state || !inputs[f].sym_map) { \
+            printf("Error: Out of memory\n"); \
+            goto done; \
+        } \
+    } \
+    str_buf_add(&strtab, "", ""); \
+    str_buf_add(&shstrtab, "", ""); \
+    int num_out = 1; \
+\
+    /* Keep the first COMDAT group of each signature and drop later copies */ \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Shdr *sections = files[f].sections; \
+        for (size_t i = 0; i < files[f].shnum; i++) { \
+            if (sections[i].sh_type != SHT_GROUP) continue; \
+            Elf32_Word *words = (Elf32_Word *)(files[f].map + sections[i].sh_offset); \
+            Elf##N##_Sym *sig = (Elf##N##_Sym *)files[f].symtab + sections[i].sh_info; \
+            const char *name = files[f].strtab + sig->st_name; \
+            sym_slot *slot = sym_table_get(&signatures, name); \
+            char state = GROUP_KEPT; \
+            if (words[0] & GRP_COMDAT) { \
+                if (slot->value != -1) state = GROUP_DISCARDED; \
+                slot->value = f; \
+            } \
+            inputs[f].group_state[i] = state; \
+            for (size_t k = 1; k < sections[i].sh_size / sizeof(Elf32_Word); k++) { \
+                inputs[f].group_state[words[k]] = state; \
+            } \
+        } \
+    } \
+\
+    /* Map data sections: same-named ones outside groups share an output */ \
+    /* section, and each kept group and group member gets its own */ \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Shdr *sections = files[f].sections; \
+        const char *sec_names = files[f].shstrtab; \
+        for (size_t i = 1; i < files[f].shnum; i++) { \
+            Elf##N##_Shdr *sec = &sections[i]; \
+            if (sec->sh_type == SHT_SYMTAB || sec->sh_type == SHT_STRTAB || sec->sh_type == SHT_REL || \
+                sec->sh_type == SHT_RELA || sec->sh_type == SHT_SYMTAB_SHNDX || \
+                inputs[f].group_state[i] == GROUP_DISCARDED) continue; \
+            const char *name = sec_names + sec->sh_name; \
+            sym_slot *slot = inputs[f].group_state[i] ? NULL : sym_table_get(&names, name); \
+            int o; \
+            if (slot && slot->value != -1) { \
+                o = slot->value; \
+                if (out[o].sh_entsize != sec->sh_entsize) { \
+                    out[o].sh_entsize = 0; \
+                    out[o].sh_flags &= ~(Elf##N##_Xword)(SHF_MERGE | SHF_STRINGS); \
+                } \
+                if (sec->sh_addralign > out[o].sh_addralign) out[o].sh_addralign = sec->sh_addralign; \
+                if (sec->sh_type != SHT_NOBITS) out[o].sh_type = sec->sh_type; \
+            } else { \
+                o = num_out++; \
+                if (slot) slot->value = o; \
+                out[o] = *sec; \
+                out[o].sh_name = str_buf_add(&shstrtab, "", name); \
+                out[o].sh_size = 0; \
+                out[o].sh_link = sec->sh_flags & SHF_LINK_ORDER && sec->sh_link < files[f].shnum ? \
+                    inputs[f].sec_map[sec->sh_link] : 0; \
+                out[o].sh_info = 0; \
+            } \
+            if (sec->sh_addralign > 1) { \
+                out[o].sh_size = (out[o].sh_size + sec->sh_addralign - 1) & ~(Elf##N##_Xword)(sec->sh_addralign - 1); \
+            } \
+            inputs[f].sec_map[i] = o; \
+            inputs[f].sec_off[i] = out[o].sh_size; \
+            out[o].sh_size += sec->sh_size; \
+        } \
+    } \
+    int num_data = num_out; \
+\
+    /* One output relocation section per output section and type, sized by */ \
+    /* adding up the input sections that relocate into it */ \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Shdr *sections = files[f].sections; \
+        const char *sec_names = files[f].shstrtab; \
+        for (size_t i = 1; i < files[f].shnum; i++) { \
+            Elf##N##_Shdr *sec = &sections[i]; \
+            if (sec->sh_type != SHT_REL && sec->sh_type != SHT_RELA) continue; \
+            int target = inputs[f].sec_map[sec->sh_info]; \
+            if (!target || inputs[f].group_state[i] == GROUP_DISCARDED) continue; \
+            int *r = &rel_out[2 * target + (sec->sh_type == SHT_RELA)]; \
+            if (!*r) { \
+                *r = num_out++; \
+                out[*r] = *sec; \
+                out[*r].sh_name = str_buf_add(&shstrtab, sec->sh_type == SHT_RELA ? ".rela" : ".rel", \
+                    sec_names + sections[sec->sh_info].sh_name); \
+                out[*r].sh_size = 0; \
+                out[*r].sh_info = target; \
+            } \
+            inputs[f].sec_map[i] = *r; \
+            out[*r].sh_size += sec->sh_size; \
+        } \
+    } \
+    int symtab_idx = num_out++; \
+    int strtab_idx = num_out++; \
+    int shstrtab_idx = num_out++; \
+    for (int o = num_data; o < symtab_idx; o++) out[o].sh_link = symtab_idx; \
+\
+    /* Locals first, as the symbol table requires, each moved by the offset */ \
+    /* its input section landed at; locals of dropped sections are dropped */ \
+    int num_syms = 1; \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Sym *syms = files[f].symtab; \
+        const char *str = files[f].strtab; \
+        for (size_t j = 1; j < files[f].num_syms; j++) { \
+            Elf##N##_Sym sym = syms[j]; \
+            if (ELF##N##_ST_BIND(sym.st_info) != STB_LOCAL) continue; \
+            if (sym.st_shndx != SHN_UNDEF && sym.st_shndx < SHN_LORESERVE) { \
+                if (!inputs[f].sec_map[sym.st_shndx]) continue; \
+                sym.st_value += inputs[f].sec_off[sym.st_shndx]; \
+                sym.st_shndx = inputs[f].sec_map[sym.st_shndx]; \
+            } \
+            sym.st_name = str[sym.st_name] ? str_buf_add(&strtab, "", str + sym.st_name) : 0; \
+            out_syms[num_syms] = sym; \
+            inputs[f].sym_map[j] = num_syms++; \
+        } \
+    } \
+    int first_global = num_syms; \
+\
+    /* Globals are merged by name; definitions in dropped sections become */ \
+    /* references that resolve to the copy that was kept */ \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Sym *syms = files[f].symtab; \
+        const char *str = files[f].strtab; \
+        for (size_t j = 1; j < files[f].num_syms; j++) { \
+            Elf##N##_Sym sym = syms[j]; \
+            if (ELF##N##_ST_BIND(sym.st_info) == STB_LOCAL) continue; \
+            if (sym.st_shndx != SHN_UNDEF && sym.st_shndx < SHN_LORESERVE) { \
+                if (inputs[f].sec_map[sym.st_shndx]) { \
+                    sym.st_value += inputs[f].sec_off[sym.st_shndx]; \
+                    sym.st_shndx = inputs[f].sec_map[sym.st_shndx]; \
+                } else { \
+                    sym.st_shndx = SHN_UNDEF; \
+                    sym.st_value = 0; \
+                    sym.st_size = 0; \
+                } \
+            } \
+            sym_slot *slot = sym_table_get(&globals, str + sym.st_name); \
+            if (slot->value == -1) { \
+                sym.st_name = str_buf_add(&strtab, "", str + sym.st_name); \
+                out_syms[num_syms] = sym; \
+                slot->value = num_syms++; \
+            } else { \
+                resolve_symbol##N(&out_syms[slot->value], &sym, slot->name); \
+            } \
+            inputs[f].sym_map[j] = slot->value; \
+        } \
+    } \
+\
+    /* Relocations: rebase offsets into the output section and renumber symbols */ \
+    size_t rel_offset = 0; \
+    for (int o = num_data; o < symtab_idx; o++) { \
+        rel_fill[o] = rel_offset; \
+        rel_offset += out[o].sh_size; \
+    } \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Shdr *sections = files[f].sections; \
+        for (size_t i = 1; i < files[f].shnum; i++) { \
+            Elf##N##_Shdr *sec = &sections[i]; \
+            if ((sec->sh_type != SHT_REL && sec->sh_type != SHT_RELA) || !inputs[f].sec_map[i]) continue; \
+            int o = inputs[f].sec_map[i]; \
+            memcpy(rel_data + rel_fill[o], files[f].map + sec->sh_offset, sec->sh_size); \
+            for (size_t off = 0; off < sec->sh_size; off += sec->sh_entsize) { \
+                Elf##N##_Rel *rel = (Elf##N##_Rel *)(rel_data + rel_fill[o] + off); \
+                rel->r_offset += inputs[f].sec_off[sec->sh_info]; \
+                rel->r_info = ELF##N##_R_INFO(inputs[f].sym_map[ELF##N##_R_SYM(rel->r_info)], \
+                    ELF##N##_R_TYPE(rel->r_info)); \
+            } \
+            rel_fill[o] += sec->sh_size; \
+        } \
+    } \
+\
+    /* Kept groups list their members by output index */ \
+    size_t group_offset = 0; \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Shdr *sections = files[f].sections; \
+        for (size_t i = 1; i < files[f].shnum; i++) { \
+            int o = inputs[f].sec_map[i]; \
+            if (sections[i].sh_type != SHT_GROUP || !o) continue; \
+            Elf32_Word *words = (Elf32_Word *)(files[f].map + sections[i].sh_offset); \
+            size_t n = sections[i].sh_size / sizeof(Elf32_Word); \
+            Elf32_Word *dst = group_data + group_offset / sizeof(Elf32_Word); \
+            dst[0] = words[0]; \
+            for (size_t k = 1; k < n; k++) dst[k] = inputs[f].sec_map[words[k]]; \
+            out[o].sh_link = symtab_idx; \
+            out[o].sh_info = inputs[f].sym_map[sections[i].sh_info]; \
+            inputs[f].sec_off[i] = group_offset; \
+            group_offset += sections[i].sh_size; \
+        } \
+    } \
+\
+    out[symtab_idx].sh_name = str_buf_add(&shstrtab, "", ".symtab"); \
+    out[symtab_idx].sh_type = SHT_SYMTAB; \
+    out[symtab_idx].sh_size = num_syms * sizeof(Elf##N##_Sym); \
+    out[symtab_idx].sh_link = strtab_idx; \
+    out[symtab_idx].sh_info = first_global; \
+    out[symtab_idx].sh_addralign = N / 8; \
+    out[symtab_idx].sh_entsize = sizeof(Elf##N##_Sym); \
+    out[strtab_idx].sh_name = str_buf_add(&shstrtab, "", ".strtab"); \
+    out[strtab_idx].sh_type = SHT_STRTAB; \
+    out[strtab_idx].sh_size = strtab.len; \
+    out[strtab_idx].sh_addralign = 1; \
+    out[shstrtab_idx].sh_name = str_buf_add(&shstrtab, "", ".shstrtab"); \
+    out[shstrtab_idx].sh_type = SHT_STRTAB; \
+    out[shstrtab_idx].sh_size = shstrtab.len; \
+    out[shstrtab_idx].sh_addralign = 1; \
+\
+    /* Layout: ELF header, section bodies at their alignment, then the */ \
+    /* section header table */ \
+    Elf##N##_Ehdr hdr = *(Elf##N##_Ehdr *)files[0].map; \
+    int num_pieces = 0; \
+    size_t offset = sizeof(Elf##N##_Ehdr); \
+    for (int o = 1; o < num_out; o++) { \
+        if (out[o].sh_addralign > 1) { \
+            offset = (offset + out[o].sh_addralign - 1) & ~(size_t)(out[o].sh_addralign - 1); \
+        } \
+        out[o].sh_offset = offset; \
+        if (out[o].sh_type != SHT_NOBITS) offset += out[o].sh_size; \
+    } \
+    for (int f = 0; f < count; f++) { \
+        Elf##N##_Shdr *sections = files[f].sections; \
+        for (size_t i = 1; i < files[f].shnum; i++) { \
+            int o = inputs[f].sec_map[i]; \
+            if (o && o < num_data && sections[i].sh_type != SHT_NOBITS && sections[i].sh_type != SHT_GROUP) { \
+                pieces[num_pieces++] = (out_piece){out[o].sh_offset + inputs[f].sec_off[i], \
+                    files[f].map + sections[i].sh_offset, sections[i].sh_size}; \
+            } else if (o && sections[i].sh_type == SHT_GROUP) { \
+                pieces[num_pieces++] = (out_piece){out[o].sh_offset, \
+                    group_data + inputs[f].sec_off[i] / sizeof(Elf32_Word), sections[i].sh_size}; \
+            } \
+        } \
+    } \
+    for (int o = num_data; o < symtab_idx; o++) { \
+        pieces[num_pieces++] = (out_piece){out[o].sh_offset, rel_data + rel_fill[o] - out[o].sh_size, out[o].sh_size}; \
+    } \
+    pieces[num_pieces++] = (out_piece){out[symtab_idx].sh_offset, out_syms, out[symtab_idx].sh_size}; \
+    pieces[num_pieces++] = (out_piece){out[strtab_idx].sh_offset, strtab.data, strtab.len}; \
+    pieces[num_pieces++] = (out_piece){out[shstrtab_idx].sh_offset, shstrtab.data, shstrtab.len}; \
+\
+    offset = (offset + 7) & ~(size_t)7; \
+    hdr.e_shoff = offset; \
+    hdr.e_shnum = num_out; \
+    hdr.e_shstrndx = shstrtab_idx; \
+    hdr.e_phoff = 0; \
+    hdr.e_phnum = 0; \
+    pieces[num_pieces++] = (out_piece){0, &hdr, sizeof(hdr)}; \
+    pieces[num_pieces++] = (out_piece){offset, out, num_out * sizeof(Elf##N##_Shdr)}; \
+    offset += num_out * sizeof(Elf##N##_Shdr); \
+\
+    result = write_layout(outfd, pieces, num_pieces, offset); \
+\
+done: \
+    for (int f = 0; inputs && f < count; f++) { \
+        free(inputs[f].sec_map); \
+        free(inputs[f].sec_off); \
+        free(inputs[f].group_state); \
+        free(inputs[f].sym_map); \
+    } \
+    free(inputs); \
+    free(out); \
+    free(rel_out); \
+    free(rel_fill); \
+    free(out_syms); \
+    free(rel_data); \
+    free(group_data); \
+    free(pieces); \
+    free(strtab.data); \
+    free(shstrtab.data); \
+    sym_table_free(&names); \
+    sym_table_free(&globals); \
+    sym_table_free(&signatures); \
+    return result; \
+}
+
+ELF_CLASS_FUNCS(32)
+ELF_CLASS_FUNCS(64)
+
+// Calls the specialization of fn that matches the file's class
+#define ELF_DISPATCH(f, fn, ...) \
+    ((f)->cls == ELFCLASS64 ? fn##64(__VA_ARGS__) : fn##32(__VA_ARGS__))
+
+ElfFile* add_file(ElfState* s) {
+    if (s->num_files == s->cap_files) {
+        int cap = s->cap_files ? s->cap_files * 2 : 4;
+        ElfFile *files = realloc(s->files, cap * sizeof(ElfFile));
+        if (!files) {
+            printf("Error: Out of memory\n");
+            return NULL;
+        }
+        s->files = files;
+        s->cap_files = cap;
+    }
+    return &s->files[s->num_files++];
+}
+
+// Opens and maps path into f. On failure err holds the reason and nothing stays open.
+int open_elf(ElfFile* f, const char* path, char* err, size_t errlen) {
+    int fd = open(path, O_RDONLY);
     if (fd < 0) {
-        perror("Error: Failed to open file");
-        return;
+        snprintf(err, errlen, "Failed to open file: %s", strerror(errno));
+        return -1;
     }
 
     off_t size = lseek(fd, 0, SEEK_END);
     if (size == -1) {
-        perror("Error: Failed to get file size");
+        snprintf(err, errlen, "Failed to get file size: %s", strerror(errno));
         close(fd);
-        return;
+        return -1;
+    }
+    if (size < EI_NIDENT) {
+        snprintf(err, errlen, "Not an ELF file");
+        close(fd);
+        return -1;
     }
 
     void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (map == MAP_FAILED) {
-        perror("Error: Failed to map file");
+        snprintf(err, errlen, "Failed to map file: %s", strerror(errno));
         close(fd);
-        return;
+        return -1;
+    }
+
+    unsigned char *ident = (unsigned char *)map;
+    if (strncmp((char*)ident, ELFMAG, SELFMAG) != 0) {
+        snprintf(err, errlen, "Not an ELF file");
+        munmap(map, size);
+        close(fd);
+        return -1;
     }
 
-    Elf32_Ehdr *hdr = (Elf32_Ehdr *)map;
-    if (strncmp((char*)hdr->e_ident, ELFMAG, SELFMAG) != 0) {
-        printf("Error: Not an ELF file\n");
+    int cls = ident[EI_CLASS];
+    size_t hdr_size = cls == ELFCLASS64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    if ((cls != ELFCLASS32 && cls != ELFCLASS64) || size < hdr_size) {
+        snprintf(err, errlen, "Unsupported ELF class %d", cls);
         munmap(map, size);
         close(fd);
+        return -1;
+    }
+
+    f->fd = fd;
+    f->cls = cls;
+    f->map = map;
+    f->size = size;
+    snprintf(f->name, sizeof(f->name), "%s", path);
+    if (ELF_DISPATCH(f, parse_elf, f, err, errlen) != 0) {
+        munmap(map, size);
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+void close_elf(ElfFile* f) {
+    munmap(f->map, f->size);
+    close(f->fd);
+}
+
+void examine_elf(ElfState* s) {
+    printf("Enter ELF file name: ");
+    char fname[256];
+    fgets(fname, sizeof(fname), stdin);
+    fname[strcspn(fname, "\n")] = '\0';
+
+    ElfFile file;
+    char err[512];
+    if (open_elf(&file, fname, err, sizeof(err)) != 0) {
+        printf("Error: %s\n", err);
         return;
     }
+    ElfFile *f = add_file(s);
+    if (!f) {
+        close_elf(&file);
+        return;
+    }
+    *f = file;
 
+    unsigned char *ident = (unsigned char *)f->map;
     printf("\n");
-    printf("Magic: %c%c%c\n", hdr->e_ident[1], hdr->e_ident[2], hdr->e_ident[3]);
-    printf("Data:%s\n", hdr->e_ident[EI_DATA] == ELFDATA2LSB ? "2's complement, little endian" : "Unknown");
-    printf("Entry point: 0x%x\n", hdr->e_entry);
-    printf("Section header offset: %d\n", hdr->e_shoff);
-    printf("Number of section headers: %d\n", hdr->e_shnum);
-    printf("Size of section header: %d\n", hdr->e_shentsize);
-    printf("Program header offset: %d\n", hdr->e_phoff);
-    printf("Number of program headers: %d\n", hdr->e_phnum);
-    printf("Size of program header: %d\n", hdr->e_phentsize);
-
-    if (s->fd1 == -1) {
-        s->fd1 = fd;
-        s->map1 = map;
-        s->size1 = size;
-        strcpy(s->name1, fname);
-    } else {
-        s->fd2 = fd;
-        s->map2 = map;
-        s->size2 = size;
-        strcpy(s->name2, fname);
-    }
+    printf("Magic: %c%c%c\n", ident[1], ident[2], ident[3]);
+    printf("Class: %s\n", f->cls == ELFCLASS64 ? "ELF64" : "ELF32");
+    printf("Data:%s\n", ident[EI_DATA] == ELFDATA2LSB ? "2's complement, little endian" : "Unknown");
+    ELF_DISPATCH(f, print_header, f);
 }
 
 // Part 1 function
 void print_sections(ElfState* s) {
-    if (s->fd1 == -1 && s->fd2 == -1) {
+    if (s->num_files == 0) {
         printf("Error: No ELF files opened. Use 'Examine ELF File' first.\n");
         return;
     }
 
-    for (int i = 0; i < 2; i++) {
-        int fd = (i == 0) ? s->fd1 : s->fd2;
-        void *map = (i == 0) ? s->map1 : s->map2;
-        if (fd == -1) continue;
+    for (int i = 0; i < s->num_files; i++) {
+        ElfFile *f = &s->files[i];
+        ELF_DISPATCH(f, print_sections, s, f);
+    }
+}
 
-        Elf32_Ehdr *hdr = (Elf32_Ehdr *)map;
-        Elf32_Shdr *sections = (Elf32_Shdr *)(map + hdr->e_shoff);
-        Elf32_Shdr *shstrtab = &sections[hdr->e_shstrndx];
-        const char *strtab = (const char *)(map + shstrtab->sh_offset);
+// Part 2 function
+void print_symbols(ElfState* s) {
+    if (s->num_files == 0) {
+        printf("No ELF files opened. Use 'Examine ELF File' first.\n");
+        return;
+    }
 
-        printf("\nFile: %s\n", (i == 0) ? s->name1 : s->name2);
+    for (int i = 0; i < s->num_files; i++) {
+        ElfFile *f = &s->files[i];
+        ELF_DISPATCH(f, print_symbols, s, f);
+    }
+}
 
-        if (s->dbg) {
-            printf("Debug: ELF header details:\n");
-            printf("  e_shoff: %x\n", hdr->e_shoff);
-            printf("  e_shnum: %d\n", hdr->e_shnum);
-            printf("  e_shstrndx: %d\n", hdr->e_shstrndx);
-            printf("Debug: shstrtab details:\n");
-            printf("  shstrtab_offset: %x\n", shstrtab->sh_offset);
-            printf("  shstrtab_size: %x\n", shstrtab->sh_size);
-        }
+// Part 3 functions; check_merge compares the first two opened files and
+// merge_files combines all of them
+int check_merge_pair(ElfState* s) {
+    if (s->num_files < 2) {
+        printf("Two ELF files must be open for merging.\n");
+        return 0;
+    }
+    if (s->files[0].cls != s->files[1].cls) {
+        printf("Cannot merge ELF32 and ELF64 files.\n");
+        return 0;
+    }
+    return 1;
+}
 
-        printf("[index] section_name             section_address section_offset section_size section_type\n");
+void check_merge(ElfState* s) {
+    if (!check_merge_pair(s)) return;
+    ELF_DISPATCH(&s->files[0], check_merge, &s->files[0], &s->files[1]);
+}
 
-        for (int j = 0; j < hdr->e_shnum; j++) {
-            printf("[%2d] %-24s 0x%08x      0x%06x         0x%06x       %s\n",
-                j,
-                &strtab[sections[j].sh_name],
-                sections[j].sh_addr,
-                sections[j].sh_offset,
-                sections[j].sh_size,
-                get_section_type(sections[j].sh_type));
+void merge_files(ElfState* s) {
+    if (s->num_files < 2) {
+        printf("At least two ELF files must be open for merging.\n");
+        return;
+    }
+    for (int i = 1; i < s->num_files; i++) {
+        if (s->files[i].cls != s->files[0].cls) {
+            printf("Cannot merge ELF32 and ELF64 files.\n");
+            return;
         }
     }
-}
 
-// Helper function for Parts 2 and 3
-const char* get_section_name(Elf32_Ehdr *hdr, int idx) {
-    if (idx >= 0 && idx < hdr->e_shnum) {
-        Elf32_Shdr *sections = (Elf32_Shdr *)((char *)hdr + hdr->e_shoff);
-        Elf32_Shdr *shstrtab = &sections[hdr->e_shstrndx];
-        char *strtab = (char *)hdr + shstrtab->sh_offset;
-        return strtab + sections[idx].sh_name;
+    int outfd = open("out.ro", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (outfd == -1) {
+        perror("Failed to create output file");
+        return;
     }
-    return "Unavailable";
+
+    int failed = ELF_DISPATCH(&s->files[0], merge_files, s->files, s->num_files, outfd);
+
+    close(outfd);
+    if (!failed) printf("Merged file created as 'out.ro'\n");
 }
 
-// Part 2 function
-void print_symbols(ElfState* s) {
-    if (s->fd1 == -1 && s->fd2 == -1) {
-        printf("No ELF files opened. Use 'Examine ELF File' first.\n");
-        return;
+void quit(ElfState* s) {
+    for (int i = 0; i < s->num_files; i++) {
+        close_elf(&s->files[i]);
     }
+    free(s->files);
+    printf("Exiting...\n");
+    exit(0);
+}
 
-    for (int i = 0; i < 2; i++) {
-        void *map = (i == 0) ? s->map1 : s->map2;
-        int fd = (i == 0) ? s->fd1 : s->fd2;
-        if (fd == -1) continue;
+// Batch listing of one opened file: a JSON line, or File: blocks like the menu's
+void write_file(out_writer* w, ElfFile* f, int sections, int symbols) {
+    if (w->json) {
+        writer_str(w, "{\"file\":");
+        writer_json_str(w, f->name);
+        writer_str(w, f->cls == ELFCLASS64 ? ",\"class\":64" : ",\"class\":32");
+    }
+    if (sections) {
+        if (!w->json) {
+            writer_str(w, "\nFile: ");
+            writer_str(w, f->name);
+            writer_str(w, "\n");
+        }
+        ELF_DISPATCH(f, write_sections, w, f);
+    }
+    if (symbols) {
+        if (!w->json) {
+            writer_str(w, "\nFile: ");
+            writer_str(w, f->name);
+            writer_str(w, "\n");
+        }
+        ELF_DISPATCH(f, write_symbols, w, f);
+    }
+    if (w->json) writer_str(w, "}\n");
+}
 
-        Elf32_Ehdr *hdr = (Elf32_Ehdr *)map;
-        Elf32_Shdr *sections = (Elf32_Shdr *)((char *)hdr + hdr->e_shoff);
-        Elf32_Shdr *symtab = NULL;
-        Elf32_Shdr *strtab = NULL;
+// Parallel batch: where the listing of one input ended up
+typedef struct batch_item {
+    int worker;      // whose writer holds the listing
+    size_t offset;   // position of the listing in that writer's memory
+    size_t len;
+    char *error;     // why the file could not be read, NULL if it was
+} batch_item;
 
-        for (int j = 0; j < hdr->e_shnum; j++) {
-            if (sections[j].sh_type == SHT_SYMTAB) {
-                symtab = &sections[j];
-                strtab = &sections[sections[j].sh_link];
-                break;
-            }
-        }
+// State shared by the batch workers. Everything but the two counters is read-only
+// or written at an index owned by one worker.
+typedef struct batch_job {
+    char **paths;
+    int num_paths;
+    int sections;
+    int symbols;
+    batch_item *items;
+    out_writer *writers;  // one per worker, collecting in memory
+    int next_path;        // next input to claim
+    int next_worker;      // next writer to hand out
+} batch_job;
 
-        if (!symtab || !strtab) {
-            printf("No symbol table found in ELF file.\n");
+// Claims inputs one at a time until none are left, so a worker that drew small
+// files simply takes more of them. Inputs are independent and claiming one is a
+// single atomic add, so one shared counter balances the load as well as per-worker
+// queues with stealing would, without their bookkeeping.
+void* batch_worker(void* arg) {
+    batch_job *job = arg;
+    int id = __atomic_fetch_add(&job->next_worker, 1, __ATOMIC_RELAXED);
+    out_writer *w = &job->writers[id];
+    int i;
+    while ((i = __atomic_fetch_add(&job->next_path, 1, __ATOMIC_RELAXED)) < job->num_paths) {
+        batch_item *item = &job->items[i];
+        ElfFile f;
+        char err[512];
+        item->worker = id;
+        item->offset = writer_pos(w);
+        if (open_elf(&f, job->paths[i], err, sizeof(err)) != 0) {
+            item->error = strdup(err);
             continue;
         }
+        write_file(w, &f, job->sections, job->symbols);
+        close_elf(&f);
+        item->len = writer_pos(w) - item->offset;
+    }
+    writer_spill(w);
+    return NULL;
+}
 
-        int sym_count = symtab->sh_size / sizeof(Elf32_Sym);
-        Elf32_Sym *syms = (Elf32_Sym *)((char *)hdr + symtab->sh_offset);
-        const char *str_table = (const char *)((char *)hdr + strtab->sh_offset);
+// Lists the inputs on num_threads workers, then writes the listings in input order
+int run_parallel(batch_job* job, out_writer* out, int num_threads) {
+    job->items = calloc(job->num_paths, sizeof(batch_item));
+    job->writers = malloc(num_threads * sizeof(out_writer));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    if (!job->items || !job->writers || !threads) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(job->items);
+        free(job->writers);
+        free(threads);
+        return 1;
+    }
+    for (int t = 0; t < num_threads; t++) writer_init(&job->writers[t], NULL, out->json);
+    job->next_path = 0;
+    job->next_worker = 0;
 
-        if (s->dbg) {
-            printf("Debug: Symbol table size: %d\n", symtab->sh_size);
-            printf("Debug: Number of symbols: %d\n", sym_count);
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, job) != 0) break;
+    }
+    if (started == 0) batch_worker(job);
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+
+    int failed = 0;
+    for (int i = 0; i < job->num_paths; i++) {
+        batch_item *item = &job->items[i];
+        if (item->error) {
+            fprintf(stderr, "%s: %s\n", job->paths[i], item->error);
+            free(item->error);
+            failed = 1;
+        } else {
+            writer_bytes(out, job->writers[item->worker].mem + item->offset, item->len);
         }
+    }
+    for (int t = 0; t < num_threads; t++) free(job->writers[t].mem);
+    free(job->items);
+    free(job->writers);
+    free(threads);
+    return failed;
+}
 
-        printf("\nFile: %s\n", (i == 0) ? s->name1 : s->name2);
-        printf("[index] value section_index section_name symbol_name\n");
+// Non-interactive mode: myELF [--sections] [--symbols] [--json] [-j threads] file...
+// With neither listing option both are written. With more than one thread the
+// files are parsed in parallel and the output still follows the input order.
+// Unreadable files are reported on stderr.
+int run_batch(int argc, char **argv) {
+    int sections = 0, symbols = 0, json = 0, failed = 0;
+    int num_threads = get_nprocs();
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "--sections") == 0) {
+            sections = 1;
+        } else if (strcmp(argv[first], "--symbols") == 0) {
+            symbols = 1;
+        } else if (strcmp(argv[first], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[first], "-j") == 0 && first + 1 < argc) {
+            num_threads = atoi(argv[++first]);
+        } else if (strcmp(argv[first], "--") == 0) {
+            first++;
+            break;
+        } else {
+            first = argc;
+        }
+    }
+    if (first >= argc) {
+        fprintf(stderr, "Usage: %s [--sections] [--symbols] [--json] [-j threads] <file>...\n", argv[0]);
+        return 2;
+    }
+    if (!sections && !symbols) sections = symbols = 1;
+    if (num_threads > argc - first) num_threads = argc - first;
 
-        for (int j = 0; j < sym_count; j++) {
-            printf("[%2d] 0x%08x %d %s %s\n",
-                j,
-                syms[j].st_value,
-                syms[j].st_shndx,
-                get_section_name(hdr, syms[j].st_shndx),
-                str_table + syms[j].st_name);
+    out_writer *w = malloc(sizeof(out_writer));
+    if (!w) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    writer_init(w, stdout, json);
+    if (num_threads > 1) {
+        batch_job job = {argv + first, argc - first, sections, symbols};
+        failed = run_parallel(&job, w, num_threads);
+    } else {
+        for (int i = first; i < argc; i++) {
+            ElfFile f;
+            char err[512];
+            if (open_elf(&f, argv[i], err, sizeof(err)) != 0) {
+                fprintf(stderr, "%s: %s\n", argv[i], err);
+                failed = 1;
+                continue;
+            }
+            write_file(w, &f, sections, symbols);
+            close_elf(&f);
         }
     }
+    writer_flush(w);
+    free(w);
+    return failed;
 }
 
-// Part 3 functions
-void check_merge(ElfState* s) {
-    if (s->fd1 == -1 || s->fd2 == -1) {
-        printf("Two ELF files must be open for merging.\n");
-        return;
+// An ELFX index mapped for queries. open_index checks the header, that every
+// table lies inside the mapping and that every symbol, file and order entry points
+// inside its table; strings are bounds-checked as they are read.
+typedef struct index_db {
+    void *map;
+    size_t size;
+    const index_header *hdr;
+    const index_file *files;
+    const index_symbol *symbols;
+    const unsigned int *by_name;
+    const unsigned int *by_addr;
+    const char *strings;
+} index_db;
+
+const char* index_str(const index_db* db, unsigned long long offset) {
+    return offset < db->hdr->strings_size ? db->strings + offset : "";
+}
+
+// Whether count entries of elem_size at offset lie inside a file of size bytes,
+// at an 8-byte aligned offset as write_index places them
+int index_table_fits(unsigned long long size, unsigned long long offset, unsigned long long count, size_t elem_size) {
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / elem_size;
+}
+
+// Returns 0 if path holds a usable index, -1 if it is missing, corrupt or from another version
+int open_index(index_db* db, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(index_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const index_header *hdr = map;
+    const char *base = map;
+    unsigned long long size = st.st_size;
+    int valid = memcmp(hdr->magic, "ELFX", 4) == 0 && hdr->version == INDEX_VERSION &&
+        hdr->strings_size > 0 && hdr->num_by_addr <= hdr->num_symbols &&
+        index_table_fits(size, hdr->files_offset, hdr->num_files, sizeof(index_file)) &&
+        index_table_fits(size, hdr->symbols_offset, hdr->num_symbols, sizeof(index_symbol)) &&
+        index_table_fits(size, hdr->by_name_offset, hdr->num_symbols, sizeof(unsigned int)) &&
+        index_table_fits(size, hdr->by_addr_offset, hdr->num_by_addr, sizeof(unsigned int)) &&
+        index_table_fits(size, hdr->strings_offset, hdr->strings_size, 1) &&
+        base[hdr->strings_offset + hdr->strings_size - 1] == '\0';
+    if (!valid) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Queries index the tables with each other's entries without checking them again
+    const index_file *files = (const index_file *)(base + hdr->files_offset);
+    const index_symbol *symbols = (const index_symbol *)(base + hdr->symbols_offset);
+    const unsigned int *by_name = (const unsigned int *)(base + hdr->by_name_offset);
+    const unsigned int *by_addr = (const unsigned int *)(base + hdr->by_addr_offset);
+    for (unsigned int i = 0; valid && i < hdr->num_files; i++) {
+        valid = files[i].first_symbol <= hdr->num_symbols &&
+            files[i].num_symbols <= hdr->num_symbols - files[i].first_symbol &&
+            files[i].first_addr <= hdr->num_by_addr &&
+            files[i].num_addr <= hdr->num_by_addr - files[i].first_addr;
+    }
+    for (unsigned int i = 0; valid && i < hdr->num_symbols; i++) {
+        valid = symbols[i].file < hdr->num_files && by_name[i] < hdr->num_symbols;
+    }
+    for (unsigned int i = 0; valid && i < hdr->num_by_addr; i++) {
+        valid = by_addr[i] < hdr->num_symbols;
+    }
+    if (!valid) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    db->map = map;
+    db->size = st.st_size;
+    db->hdr = hdr;
+    db->files = files;
+    db->symbols = symbols;
+    db->by_name = by_name;
+    db->by_addr = by_addr;
+    db->strings = base + hdr->strings_offset;
+    return 0;
+}
+
+void close_index(index_db* db) {
+    munmap(db->map, db->size);
+}
+
+// qsort has no context argument; the index being sorted is published here
+const index_symbol *sort_symbols;
+const char *sort_strings;
+
+int compare_by_name(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    int cmp = strcmp(sort_strings + sort_symbols[x].name, sort_strings + sort_symbols[y].name);
+    if (cmp != 0) return cmp;
+    return x < y ? -1 : x > y;
+}
+
+int compare_by_addr(const void* a, const void* b) {
+    const index_symbol *x = &sort_symbols[*(const unsigned int *)a];
+    const index_symbol *y = &sort_symbols[*(const unsigned int *)b];
+    if (x->file != y->file) return x->file < y->file ? -1 : 1;
+    if (x->value != y->value) return x->value < y->value ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+// Symbols that name a location: defined, and neither a section nor a file name
+int symbol_has_address(const index_symbol* sym) {
+    int type = ELF64_ST_TYPE(sym->info);
+    return sym->shndx != SHN_UNDEF && type != STT_SECTION && type != STT_FILE;
+}
+
+// Sorts the lookup orders and writes the index next to path, then renames it into place
+int write_index(index_builder* b, const char* path) {
+    unsigned int n = b->num_symbols;
+    unsigned int *by_name = malloc((n + 1) * sizeof(unsigned int));
+    unsigned int *by_addr = malloc((n + 1) * sizeof(unsigned int));
+    if (!by_name || !by_addr) {
+        free(by_name);
+        free(by_addr);
+        return -1;
+    }
+    unsigned int num_addr = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        by_name[i] = i;
+        if (symbol_has_address(&b->symbols[i])) by_addr[num_addr++] = i;
+    }
+    sort_symbols = b->symbols;
+    sort_strings = b->strings.data;
+    qsort(by_name, n, sizeof(unsigned int), compare_by_name);
+    qsort(by_addr, num_addr, sizeof(unsigned int), compare_by_addr);
+    for (unsigned int i = 0, k = 0; i < b->num_files; i++) {
+        b->files[i].first_addr = k;
+        while (k < num_addr && b->symbols[by_addr[k]].file == i) k++;
+        b->files[i].num_addr = k - b->files[i].first_addr;
     }
 
-    Elf32_Ehdr *hdr1 = (Elf32_Ehdr *)s->map1;
-    Elf32_Ehdr *hdr2 = (Elf32_Ehdr *)s->map2;
-    Elf32_Shdr *sections1 = (Elf32_Shdr *)((char *)hdr1 + hdr1->e_shoff);
-    Elf32_Shdr *sections2 = (Elf32_Shdr *)((char *)hdr2 + hdr2->e_shoff);
-    Elf32_Shdr *symtab1 = NULL, *symtab2 = NULL;
+    index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "ELFX", 4);
+    hdr.version = INDEX_VERSION;
+    hdr.num_files = b->num_files;
+    hdr.num_symbols = n;
+    hdr.num_by_addr = num_addr;
+    hdr.strings_size = b->strings.len;
 
-    // Find symbol tables
-    for (int i = 0; i < hdr1->e_shnum; i++) {
-        if (sections1[i].sh_type == SHT_SYMTAB) {
-            if (symtab1) {
-                printf("Multiple symbol tables found in first file.\n");
-                return;
+    const void *sources[] = {b->files, b->symbols, by_name, by_addr, b->strings.data};
+    size_t sizes[] = {
+        b->num_files * sizeof(index_file),
+        n * sizeof(index_symbol),
+        n * sizeof(unsigned int),
+        num_addr * sizeof(unsigned int),
+        b->strings.len,
+    };
+    unsigned long long *offsets[] = {
+        &hdr.files_offset, &hdr.symbols_offset, &hdr.by_name_offset, &hdr.by_addr_offset, &hdr.strings_offset,
+    };
+    out_piece pieces[6] = {{0, &hdr, sizeof(hdr)}};
+    size_t offset = sizeof(hdr);
+    for (int i = 0; i < 5; i++) {
+        *offsets[i] = offset;
+        pieces[i + 1] = (out_piece){offset, sources[i], sizes[i]};
+        offset += (sizes[i] + 7) & ~(size_t)7;
+    }
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int failed = 1;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        failed = write_layout(fd, pieces, 6, offset) != 0;
+        if (close(fd) != 0) failed = 1;
+        if (!failed) failed = rename(tmp, path) != 0;
+        if (failed) unlink(tmp);
+    }
+    free(by_name);
+    free(by_addr);
+    return failed ? -1 : 0;
+}
+
+// myELF index <db> <file>...
+// Builds or refreshes the index of the given files. Files whose size and mtime
+// match their entry in the existing index keep their symbols; only the others
+// are parsed again. Files no longer listed are dropped from the index.
+int build_index(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s index <db> <file>...\n", argv[0]);
+        return 2;
+    }
+    index_db old;
+    int have_old = open_index(&old, argv[2]) == 0;
+    sym_table old_paths = {0};
+    if (sym_table_init(&old_paths, have_old ? old.hdr->num_files : 0) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    for (unsigned int i = 0; have_old && i < old.hdr->num_files; i++) {
+        sym_table_get(&old_paths, index_str(&old, old.files[i].path))->value = i;
+    }
+
+    index_builder b = {0};
+    str_buf_add(&b.strings, "", "");
+    unsigned int reused = 0, parsed = 0;
+    int failed = 0;
+    for (int i = 3; i < argc && !failed; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) != 0) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            continue;
+        }
+        if (b.num_files == b.cap_files) {
+            unsigned int cap = b.cap_files ? b.cap_files * 2 : 64;
+            index_file *files = realloc(b.files, cap * sizeof(index_file));
+            if (!files) {
+                failed = 1;
+                break;
             }
-            symtab1 = &sections1[i];
+            b.files = files;
+            b.cap_files = cap;
         }
-    }
+        index_file *entry = &b.files[b.num_files];
+        memset(entry, 0, sizeof(*entry));
+        entry->path = str_buf_add(&b.strings, "", argv[i]);
+        entry->size = st.st_size;
+        entry->mtime_sec = st.st_mtim.tv_sec;
+        entry->mtime_nsec = st.st_mtim.tv_nsec;
+        entry->first_symbol = b.num_symbols;
 
-    for (int i = 0; i < hdr2->e_shnum; i++) {
-        if (sections2[i].sh_type == SHT_SYMTAB) {
-            if (symtab2) {
-                printf("Multiple symbol tables found in second file.\n");
-                return;
+        sym_slot *slot = have_old ? sym_table_find(&old_paths, argv[i], sym_hash(argv[i])) : NULL;
+        const index_file *prev = slot && slot->name ? &old.files[slot->value] : NULL;
+        if (prev && prev->size == entry->size && prev->mtime_sec == entry->mtime_sec &&
+            prev->mtime_nsec == entry->mtime_nsec && prev->first_symbol <= old.hdr->num_symbols &&
+            prev->num_symbols <= old.hdr->num_symbols - prev->first_symbol) {
+            if (index_reserve(&b, prev->num_symbols) != 0) {
+                failed = 1;
+                break;
+            }
+            for (unsigned int k = 0; k < prev->num_symbols; k++) {
+                index_symbol sym = old.symbols[prev->first_symbol + k];
+                sym.name = str_buf_add(&b.strings, "", index_str(&old, sym.name));
+                sym.section = sym.section ? str_buf_add(&b.strings, "", index_str(&old, sym.section)) : 0;
+                sym.file = b.num_files;
+                b.symbols[b.num_symbols++] = sym;
+            }
+            reused++;
+        } else {
+            ElfFile f;
+            char err[512];
+            if (open_elf(&f, argv[i], err, sizeof(err)) != 0) {
+                fprintf(stderr, "%s: %s\n", argv[i], err);
+                continue;
             }
-            symtab2 = &sections2[i];
+            failed = ELF_DISPATCH(&f, index_symbols, &b, &f, b.num_files) != 0;
+            close_elf(&f);
+            parsed++;
         }
+        entry->num_symbols = b.num_symbols - entry->first_symbol;
+        b.num_files++;
     }
 
-    if (!symtab1 || !symtab2) {
-        printf("Symbol table missing in one or both files.\n");
-        return;
+    if (failed) {
+        fprintf(stderr, "Error: Out of memory\n");
+    } else if (write_index(&b, argv[2]) != 0) {
+        fprintf(stderr, "%s: Failed to write index\n", argv[2]);
+        failed = 1;
+    } else {
+        printf("Indexed %u files (%u parsed, %u unchanged), %u symbols\n",
+            b.num_files, parsed, reused, b.num_symbols);
     }
+    sym_table_free(&old_paths);
+    if (have_old) close_index(&old);
+    free(b.files);
+    free(b.symbols);
+    free(b.strings.data);
+    return failed;
+}
 
-    Elf32_Sym *syms1 = (Elf32_Sym *)((char *)hdr1 + symtab1->sh_offset);
-    Elf32_Sym *syms2 = (Elf32_Sym *)((char *)hdr2 + symtab2->sh_offset);
-    const char *strtab1 = (const char *)((char *)hdr1 + sections1[symtab1->sh_link].sh_offset);
-    const char *strtab2 = (const char *)((char *)hdr2 + sections2[symtab2->sh_link].sh_offset);
-    int sym_count1 = symtab1->sh_size / sizeof(Elf32_Sym);
-    int sym_count2 = symtab2->sh_size / sizeof(Elf32_Sym);
-
-    for (int i = 1; i < sym_count1; i++) {
-        const char *name1 = strtab1 + syms1[i].st_name;
-        
-        if (ELF32_ST_BIND(syms1[i].st_info) == STB_GLOBAL) {
-            if (syms1[i].st_shndx == SHN_UNDEF) {
-                // Check undefined symbols
-                int defined = 0;
-                for (int j = 1; j < sym_count2; j++) {
-                    const char *name2 = strtab2 + syms2[j].st_name;
-                    if (strcmp(name1, name2) == 0 && syms2[j].st_shndx != SHN_UNDEF) {
-                        defined = 1;
-                        break;
-                    }
-                }
-                if (!defined) printf("Symbol %s undefined\n", name1);
+// myELF find <db> <name>...
+// Lists the files that define each name, by binary search of the name order
+int find_symbols(int argc, char **argv) {
+    index_db db;
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s find <db> <name>...\n", argv[0]);
+        return 2;
+    }
+    if (open_index(&db, argv[2]) != 0) {
+        fprintf(stderr, "%s: Missing or corrupt index, rebuild it with 'index'\n", argv[2]);
+        return 1;
+    }
+    out_writer *w = malloc(sizeof(out_writer));
+    if (!w) {
+        close_index(&db);
+        return 1;
+    }
+    writer_init(w, stdout, 0);
+    int missing = 0;
+    for (int i = 3; i < argc; i++) {
+        unsigned int lo = 0, hi = db.hdr->num_symbols;
+        while (lo < hi) {
+            unsigned int mid = lo + (hi - lo) / 2;
+            if (strcmp(index_str(&db, db.symbols[db.by_name[mid]].name), argv[i]) < 0) {
+                lo = mid + 1;
             } else {
-                // Check multiply defined symbols
-                for (int j = 1; j < sym_count2; j++) {
-                    const char *name2 = strtab2 + syms2[j].st_name;
-                    if (strcmp(name1, name2) == 0 && syms2[j].st_shndx != SHN_UNDEF) {
-                        printf("Symbol %s multiply defined\n", name1);
-                        break;
-                    }
-                }
+                hi = mid;
             }
         }
+        int found = 0;
+        for (; lo < db.hdr->num_symbols; lo++) {
+            const index_symbol *sym = &db.symbols[db.by_name[lo]];
+            if (strcmp(index_str(&db, sym->name), argv[i]) != 0) break;
+            if (sym->shndx == SHN_UNDEF || sym->file >= db.hdr->num_files) continue;
+            writer_str(w, argv[i]);
+            writer_str(w, ": ");
+            writer_str(w, index_str(&db, db.files[sym->file].path));
+            writer_str(w, " ");
+            writer_str(w, sym->section ? index_str(&db, sym->section) : sym->shndx == SHN_ABS ? "*ABS*" : "*COM*");
+            writer_str(w, " ");
+            writer_hex(w, sym->value, 8);
+            writer_str(w, ELF64_ST_BIND(sym->info) == STB_WEAK ? " weak\n" : ELF64_ST_BIND(sym->info) == STB_LOCAL ? " local\n" : "\n");
+            found = 1;
+        }
+        if (!found) {
+            writer_str(w, argv[i]);
+            writer_str(w, ": not defined\n");
+            missing = 1;
+        }
     }
+    writer_flush(w);
+    free(w);
+    close_index(&db);
+    return missing;
 }
 
-void merge_files(ElfState* s) {
-    if (s->fd1 == -1 || s->fd2 == -1) {
-        printf("Two ELF files must be open for merging.\n");
-        return;
+int compare_intervals(const void* a, const void* b) {
+    const sym_interval *x = a, *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    if (x->rank != y->rank) return x->rank < y->rank ? -1 : 1;
+    if (x->end != y->end) return x->end > y->end ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// In-order walk of the implicit tree rooted at k, handing out sorted positions from i
+unsigned int eytzinger_fill(addr_map* m, unsigned int i, unsigned int k) {
+    if (k <= m->count) {
+        i = eytzinger_fill(m, i, 2 * k);
+        m->eyt[k] = m->intervals[i].start;
+        m->eyt_pos[k] = i++;
+        i = eytzinger_fill(m, i, 2 * k + 1);
     }
+    return i;
+}
 
-    int outfd = open("out.ro", O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (outfd == -1) {
-        perror("Failed to create output file");
-        return;
+void addr_map_free(addr_map* m) {
+    free(m->intervals);
+    free(m->eyt);
+    free(m->eyt_pos);
+}
+
+// Builds the lookup structure over the n intervals already in m->intervals:
+// sorted, one interval per start address, and symbols without a size stretched
+// to the next symbol of the same section. Frees the intervals if it fails.
+int addr_map_finish(addr_map* m, unsigned int n) {
+    qsort(m->intervals, n, sizeof(sym_interval), compare_intervals);
+
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        if (count > 0 && m->intervals[count - 1].start == m->intervals[i].start) continue;
+        m->intervals[count++] = m->intervals[i];
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        sym_interval *iv = &m->intervals[i];
+        if (iv->end > iv->start) continue;
+        iv->end = iv->start + 1;
+        if (i + 1 < count && strcmp(m->intervals[i + 1].section, iv->section) == 0) iv->end = m->intervals[i + 1].start;
     }
+    m->count = count;
 
-    Elf32_Ehdr hdr1 = *(Elf32_Ehdr*)s->map1;
-    if (hdr1.e_shoff >= s->size1) {
-        close(outfd);
-        return;
+    m->eyt = malloc((count + 1) * sizeof(unsigned long long));
+    m->eyt_pos = malloc((count + 1) * sizeof(unsigned int));
+    if (!m->eyt || !m->eyt_pos) {
+        addr_map_free(m);
+        return -1;
     }
+    eytzinger_fill(m, 0, 1);
+    while ((1u << m->depth) <= count) m->depth++;
+    return 0;
+}
 
-    Elf32_Shdr* sections1 = (Elf32_Shdr*)(s->map1 + hdr1.e_shoff);
-    Elf32_Ehdr* hdr2 = (Elf32_Ehdr*)s->map2;
-    if (hdr2->e_shoff >= s->size2) {
-        close(outfd);
-        return;
+// Builds the lookup structure for the symbols of f
+int addr_map_build(addr_map* m, ElfFile* f) {
+    memset(m, 0, sizeof(*m));
+    size_t max = f->num_syms + f->num_dynsyms;
+    if (max > 0xFFFFFFFEu) return -1;
+    m->intervals = malloc((max + 1) * sizeof(sym_interval));
+    if (!m->intervals) return -1;
+    return addr_map_finish(m, ELF_DISPATCH(f, collect_intervals, f, m->intervals));
+}
+
+// Builds the lookup structure for one file of an index, with the same choice of
+// symbols and ranking as collect_intervals. Names point into the mapped index.
+int addr_map_build_indexed(addr_map* m, const index_db* db, const index_file* file) {
+    memset(m, 0, sizeof(*m));
+    m->intervals = malloc((file->num_addr + 1) * sizeof(sym_interval));
+    if (!m->intervals) return -1;
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < file->num_addr; i++) {
+        unsigned int k = db->by_addr[file->first_addr + i];
+        if (k >= db->hdr->num_symbols) continue;
+        const index_symbol *sym = &db->symbols[k];
+        if (sym->shndx >= SHN_LORESERVE) continue;
+        sym_interval *iv = &m->intervals[n++];
+        iv->start = sym->value;
+        iv->end = sym->value + sym->size;
+        iv->name = index_str(db, sym->name);
+        iv->section = sym->section ? index_str(db, sym->section) : "";
+        int bind = ELF64_ST_BIND(sym->info);
+        iv->rank = (sym->size == 0) * 8 + (bind == STB_GLOBAL ? 0 : bind == STB_WEAK ? 1 : 2);
     }
-    Elf32_Shdr* sections2 = (Elf32_Shdr*)(s->map2 + hdr2->e_shoff);
+    return addr_map_finish(m, n);
+}
 
-    // Write initial headers
-    hdr1.e_shoff = 0x34;
-    write(outfd, &hdr1, sizeof(Elf32_Ehdr));
+// Finishes a search that fell out of the tree at k
+const sym_interval* addr_map_leaf(const addr_map* m, unsigned int k, unsigned long long addr) {
+    // Undo the right turns taken after the last left turn: k is then the first
+    // start greater than addr, or 0 if there is none
+    k >>= __builtin_ffs(~k);
+    unsigned int upper = k ? m->eyt_pos[k] : m->count;
+    if (upper == 0) return NULL;
+    const sym_interval *iv = &m->intervals[upper - 1];
+    return addr < iv->end ? iv : NULL;
+}
 
-    // Start sections at 0x174
-    off_t curr_offset = 0x174;
-    
-    // Process sections
-    for (int i = 0; i < hdr1.e_shnum; i++) {
-        if (hdr1.e_shstrndx >= hdr1.e_shnum) continue;
-        
-        Elf32_Shdr new_section = sections1[i];
-        new_section.sh_offset = curr_offset;
-
-        // Validate string table access
-        if (sections1[hdr1.e_shstrndx].sh_offset + new_section.sh_name >= s->size1) continue;
-        const char* name = (char*)(s->map1 + sections1[hdr1.e_shstrndx].sh_offset + new_section.sh_name);
-
-        if (new_section.sh_type == SHT_PROGBITS) {
-            // Validate section data access
-            if (sections1[i].sh_offset + sections1[i].sh_size <= s->size1) {
-                write(outfd, s->map1 + sections1[i].sh_offset, sections1[i].sh_size);
-
-                // Find and merge matching section from second file
-                for (int j = 0; j < hdr2->e_shnum; j++) {
-                    if (hdr2->e_shstrndx >= hdr2->e_shnum) continue;
-                    if (sections2[hdr2->e_shstrndx].sh_offset + sections2[j].sh_name >= s->size2) continue;
-
-                    const char* name2 = (char*)(s->map2 + sections2[hdr2->e_shstrndx].sh_offset + sections2[j].sh_name);
-                    if (strcmp(name, name2) == 0) {
-                        if (sections2[j].sh_offset + sections2[j].sh_size <= s->size2) {
-                            write(outfd, s->map2 + sections2[j].sh_offset, sections2[j].sh_size);
-                            new_section.sh_size += sections2[j].sh_size;
-                        }
-                        break;
-                    }
-                }
-            }
-        } else if (new_section.sh_type != SHT_NOBITS) {
-            if (sections1[i].sh_offset + sections1[i].sh_size <= s->size1) {
-                write(outfd, s->map1 + sections1[i].sh_offset, sections1[i].sh_size);
+// The interval containing addr, or NULL
+const sym_interval* addr_map_find(const addr_map* m, unsigned long long addr) {
+    // Descend to a leaf, going right while the start is <= addr; the prefetch
+    // fetches the node four levels down, whose 16 candidates share a cache line
+    unsigned int k = 1;
+    while (k <= m->count) {
+        __builtin_prefetch(m->eyt + 16 * k);
+        k = 2 * k + (m->eyt[k] <= addr);
+    }
+    return addr_map_leaf(m, k, addr);
+}
+
+// Resolves n addresses FIND_LANES at a time. The lanes descend the tree level by
+// level together, so their cache misses overlap instead of following each other.
+void addr_map_find_many(const addr_map* m, const unsigned long long* addrs, size_t n, const sym_interval** out) {
+    size_t i = 0;
+    for (; i + FIND_LANES <= n; i += FIND_LANES) {
+        unsigned int k[FIND_LANES];
+        for (int j = 0; j < FIND_LANES; j++) k[j] = 1;
+        for (int level = 1; level < m->depth; level++) {
+            for (int j = 0; j < FIND_LANES; j++) {
+                __builtin_prefetch(m->eyt + 16 * k[j]);
+                k[j] = 2 * k[j] + (m->eyt[k[j]] <= addrs[i + j]);
             }
         }
+        // Only the last level is partly filled
+        for (int j = 0; j < FIND_LANES; j++) {
+            if (k[j] <= m->count) k[j] = 2 * k[j] + (m->eyt[k[j]] <= addrs[i + j]);
+            out[i + j] = addr_map_leaf(m, k[j], addrs[i + j]);
+        }
+    }
+    for (; i < n; i++) out[i] = addr_map_find(m, addrs[i]);
+}
 
-        // Update section header
-        lseek(outfd, hdr1.e_shoff + i * sizeof(Elf32_Shdr), SEEK_SET);
-        write(outfd, &new_section, sizeof(Elf32_Shdr));
-        
-        curr_offset += new_section.sh_size;
-        if (new_section.sh_addralign > 1) {
-            curr_offset = (curr_offset + new_section.sh_addralign - 1) & ~(new_section.sh_addralign - 1);
+// Addresses are hex for both addr and addr2sym; strtoull takes an optional 0x
+unsigned long long parse_address(const char* s, char** end) {
+    return strtoull(s, end, 16);
+}
+
+void write_resolved(out_writer* w, unsigned long long addr, const sym_interval* iv) {
+    writer_hex(w, addr, 8);
+    if (iv) {
+        writer_str(w, " ");
+        writer_str(w, iv->name);
+        writer_str(w, "+");
+        writer_hex(w, addr - iv->start, 1);
+        writer_str(w, " ");
+        writer_str(w, iv->section);
+        writer_str(w, "\n");
+    } else {
+        writer_str(w, " ??\n");
+    }
+}
+
+// Reads whitespace-separated hex addresses until end of input; words that are not
+// numbers are skipped. Returns NULL if memory runs out.
+unsigned long long* read_addresses(FILE* in, size_t* count) {
+    size_t len = 0, size = 1 << 20, n;
+    char *input = malloc(size + 1);
+    while (input && (n = fread(input + len, 1, size - len, in)) > 0) {
+        len += n;
+        if (len == size) {
+            char *grown = realloc(input, 2 * size + 1);
+            if (!grown) free(input);
+            input = grown;
+            size *= 2;
+        }
+    }
+    // No more addresses than half the bytes: each needs a digit and a separator
+    unsigned long long *addrs = input ? malloc((len / 2 + 1) * sizeof(unsigned long long)) : NULL;
+    if (!addrs) {
+        free(input);
+        return NULL;
+    }
+    input[len] = '\0';
+    *count = 0;
+    char *p = input, *end;
+    while (*p) {
+        unsigned long long addr = parse_address(p, &end);
+        if (end == p) {
+            while (*p && !isspace((unsigned char)*p)) p++;
+            while (*p && isspace((unsigned char)*p)) p++;
+            continue;
         }
-        lseek(outfd, curr_offset, SEEK_SET);
+        addrs[(*count)++] = addr;
+        p = end;
     }
+    free(input);
+    return addrs;
+}
 
-    close(outfd);
-    printf("Merged file created as 'out.ro'\n");
+// myELF addr <db> <file> <address>...
+// Resolves hex addresses of one indexed file to symbol+offset and section, using
+// the same lookup as addr2sym over the file's run of the address order
+int find_addresses(int argc, char **argv) {
+    index_db db;
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s addr <db> <file> <address>...\n", argv[0]);
+        return 2;
+    }
+    if (open_index(&db, argv[2]) != 0) {
+        fprintf(stderr, "%s: Missing or corrupt index, rebuild it with 'index'\n", argv[2]);
+        return 1;
+    }
+    const index_file *file = NULL;
+    for (unsigned int i = 0; i < db.hdr->num_files && !file; i++) {
+        if (strcmp(index_str(&db, db.files[i].path), argv[3]) == 0) file = &db.files[i];
+    }
+    if (!file || file->first_addr > db.hdr->num_by_addr || file->num_addr > db.hdr->num_by_addr - file->first_addr) {
+        fprintf(stderr, "%s: Not in the index\n", argv[3]);
+        close_index(&db);
+        return 1;
+    }
+
+    addr_map m;
+    out_writer *w = malloc(sizeof(out_writer));
+    if (!w || addr_map_build_indexed(&m, &db, file) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(w);
+        close_index(&db);
+        return 1;
+    }
+    writer_init(w, stdout, 0);
+    for (int i = 4; i < argc; i++) {
+        unsigned long long addr = parse_address(argv[i], NULL);
+        write_resolved(w, addr, addr_map_find(&m, addr));
+    }
+    writer_flush(w);
+    free(w);
+    addr_map_free(&m);
+    close_index(&db);
+    return 0;
 }
 
-void quit(ElfState* s) {
-    if (s->fd1 != -1) {
-        munmap(s->map1, s->size1);
-        close(s->fd1);
+// myELF addr2sym <file> [address...]
+// Resolves hex addresses (0x optional) to symbol+offset and section. Without
+// addresses on the command line they are read from stdin, separated by whitespace.
+int addr2sym(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s addr2sym <file> [address...]\n", argv[0]);
+        return 2;
     }
-    if (s->fd2 != -1) {
-        munmap(s->map2, s->size2);
-        close(s->fd2);
+    ElfFile f;
+    char err[512];
+    if (open_elf(&f, argv[2], err, sizeof(err)) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[2], err);
+        return 1;
     }
-    printf("Exiting...\n");
-    exit(0);
+    addr_map m;
+    out_writer *w = malloc(sizeof(out_writer));
+    if (!w || addr_map_build(&m, &f) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(w);
+        close_elf(&f);
+        return 1;
+    }
+    writer_init(w, stdout, 0);
+
+    size_t count = 0;
+    unsigned long long *addrs;
+    if (argc > 3) {
+        addrs = malloc((argc - 3) * sizeof(unsigned long long));
+        for (int i = 3; addrs && i < argc; i++) addrs[count++] = parse_address(argv[i], NULL);
+    } else {
+        addrs = read_addresses(stdin, &count);
+    }
+
+    const sym_interval **found = addrs ? malloc((count + 1) * sizeof(sym_interval*)) : NULL;
+    if (found) {
+        addr_map_find_many(&m, addrs, count, found);
+        for (size_t i = 0; i < count; i++) write_resolved(w, addrs[i], found[i]);
+    } else {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+    free(found);
+    free(addrs);
+    writer_flush(w);
+    free(w);
+    addr_map_free(&m);
+    close_elf(&f);
+    return 0;
 }
 
+#ifndef ELF_NO_MAIN
 int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "index") == 0) return build_index(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "find") == 0) return find_symbols(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "addr") == 0) return find_addresses(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "addr2sym") == 0) return addr2sym(argc, argv);
+    if (argc > 1) return run_batch(argc, argv);
+
     while (1) {
         printf("Choose action:\n");
         for (int i = 0; i < sizeof(menu) / sizeof(menu[0]); i++) {
@@ -442,4 +2262,5 @@ int main(int argc, char **argv) {
         }
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif